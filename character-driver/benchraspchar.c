@@ -0,0 +1,123 @@
+/**
+ * @file    benchraspchar.c
+ * @author  PHAM Minh Thuc
+ * @brief   Scaling benchmark of the raspchar writes: 1 to N threads, one per CPU, write the data
+ * registers through one opened /dev/raspberrychar for a fixed time. With -r the threads read instead,
+ * which in sharded mode merges the shards of every CPU. Run it once with the module loaded normally
+ * and once with sharded=1 to compare:
+ *    ./benchraspchar [-r] [-c max_threads] [-s bytes] [-t seconds_per_step]
+*/
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<time.h>
+#include<pthread.h>
+#include<sched.h>
+
+#define NODE_DEVICE  "/dev/raspberrychar"
+#define NUM_DATA_REGS 256
+
+struct worker {
+   pthread_t thread;
+   int cpu;
+   unsigned long ops;
+};
+
+static int fd, size = 16, reads;
+static volatile int running;
+
+static uint64_t now_ns() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *worker_run(void *arg) {
+   struct worker *w = arg;
+   char buf[NUM_DATA_REGS];
+   cpu_set_t set;
+   // every thread writes its own registers, the cost measured is the one of the shared state
+   off_t offset = (w->cpu * size) % (NUM_DATA_REGS - size + 1);
+
+   CPU_ZERO(&set);
+   CPU_SET(w->cpu, &set);
+   pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+   memset(buf, w->cpu, sizeof(buf));
+   while (!running)
+      ;
+   while (running == 1) {
+      if ((reads ? pread(fd, buf, size, offset) : pwrite(fd, buf, size, offset)) < 0) {
+         perror(reads ? "Failed to read from the device" : "Failed to write to the device");
+         break;
+      }
+      w->ops++;
+   }
+   return NULL;
+}
+
+int main(int argc, char *argv[]) {
+   int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+   int seconds = 2;
+   int opt, n, i;
+   struct worker *workers;
+   unsigned long total, single = 0;
+   uint64_t start, elapsed;
+
+   while ((opt = getopt(argc, argv, "rc:s:t:")) != -1) {
+      switch (opt) {
+         case 'r': reads = 1; break;
+         case 'c': max_threads = atoi(optarg); break;
+         case 's': size = atoi(optarg); break;
+         case 't': seconds = atoi(optarg); break;
+         default:
+            fprintf(stderr, "usage: %s [-r] [-c max_threads] [-s bytes] [-t seconds_per_step]\n", argv[0]);
+            return 1;
+      }
+   }
+   if (size < 1 || size > NUM_DATA_REGS || max_threads < 1) {
+      fprintf(stderr, "bytes must be in [1, %d], threads at least 1\n", NUM_DATA_REGS);
+      return 1;
+   }
+   workers = calloc(max_threads, sizeof(*workers));
+   if (!workers)
+      return ENOMEM;
+   // the device is opened once only, the threads share the file
+   fd = open(NODE_DEVICE, O_RDWR);
+   if (fd < 0) {
+      perror("Failed to open the device...");
+      return errno;
+   }
+
+   printf("threads  %-11s  per thread   scaling (%d bytes per %s)\n", reads ? "reads/s" : "writes/s", size,
+          reads ? "read" : "write");
+   for (n = 1; n <= max_threads; n++) {
+      running = 0;
+      for (i = 0; i < n; i++) {
+         workers[i].cpu = i;
+         workers[i].ops = 0;
+         pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+      }
+      start = now_ns();
+      running = 1;
+      sleep(seconds);
+      running = 2;
+      elapsed = now_ns() - start;
+      total = 0;
+      for (i = 0; i < n; i++) {
+         pthread_join(workers[i].thread, NULL);
+         total += workers[i].ops;
+      }
+      total = total * 1000000000ULL / elapsed;
+      if (n == 1)
+         single = total;
+      printf("%7d  %-11lu  %-11lu  %.2fx\n", n, total, total / n, single ? (double)total / single : 0.0);
+   }
+   close(fd);
+   free(workers);
+   return 0;
+}
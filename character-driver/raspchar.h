@@ -5,6 +5,9 @@
  * @version 0.1
  * @brief   Contains the definitions for describing the device virtual raspchar. Raspchar device is on RAM
 */
+#ifndef RASPCHAR_H
+#define RASPCHAR_H
+
 #define REG_SIZE 1 // size of register 1 byte (8 bits)
 #define NUM_CTRL_REGS 1 //number of controller registers
 #define NUM_STS_REGS 5 //number of status registers
@@ -77,4 +80,6 @@
 
 #define ENABLE 1
 #define DISABLE 0
-/****************** Description controller register: END ******************/
\ No newline at end of file
+/****************** Description controller register: END ******************/
+
+#endif
@@ -0,0 +1,453 @@
+/**
+ * @file    raspchar_hw.c
+ * @author  PHAM Minh Thuc
+ * @brief   Hardware layer of the virtual raspchar device. With a real device, the memcpy on the registers
+ * are replaced by the bus accesses (ex: I2C_READ...)
+*/
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/sched/clock.h>      // local_clock, stamps of the writes in sharded mode
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include "raspchar_hw.h"
+
+int raspchar_hw_init(raspchar_dev_t *hw)
+{
+   char * buf;
+   buf = kzalloc(NUM_DEV_REGS * REG_SIZE, GFP_KERNEL);
+   if(!buf)
+   {
+      return -ENOMEM; 
+   }
+   hw->control_regs = buf;
+   hw->status_regs = hw->control_regs + NUM_CTRL_REGS;
+   hw->data_regs = hw->status_regs + NUM_STS_REGS;
+
+   hw->control_regs[CONTROL_ACCESS_REG] = 0x03;
+   hw->status_regs[DEVICE_STATUS_REG] = 0x03;
+   return 0;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_init);
+
+void raspchar_hw_exit(raspchar_dev_t *hw)
+{
+   raspchar_hw_shard_exit(hw);
+   raspchar_hw_bank_exit(hw);
+   kfree(hw->control_regs);
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_exit);
+
+/* Read data from rasp char device - harware virtual. If we read data from a real device, instead of using memcpy, using function to read data from device (ex: I2C_READ...*/
+int raspchar_hw_read_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf)
+{
+   int read_bytes = num_regs;
+
+   // Verify weather we can read data from data registers
+   if ((hw->control_regs[CONTROL_ACCESS_REG] & CTRL_READ_DATA_BIT) == DISABLE)
+      return -1;
+   // Verify address of kernel buffer   
+   if(kbuf == NULL)
+      return -1;
+   // Verify position the registers
+   if(start_reg > NUM_DATA_REGS)
+      return -1;
+   // Handle the number of registers read
+   if(num_regs > (NUM_DATA_REGS - start_reg))
+      read_bytes = NUM_DATA_REGS - start_reg;
+   // Write data from device to kernel buffer
+   memcpy(kbuf, hw->data_regs + start_reg, read_bytes);
+   // Update the number reading
+   hw->status_regs[READ_COUNT_L_REG] += 1;
+   if(hw->status_regs[READ_COUNT_L_REG] == 0)
+      hw->status_regs[READ_COUNT_H_REG] += 1;
+   return read_bytes;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_read_data);
+
+int raspchar_hw_write_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf)
+{
+   int write_bytes = num_regs;
+   // Verify weather we can write to data register
+   if ((hw->control_regs[CONTROL_ACCESS_REG] & CTRL_WRITE_DATA_BIT) == DISABLE)
+      return -1;
+   // Verify address of kernel buffer
+   if (kbuf == NULL)
+      return -1;
+   // Verify position of register to write on data register
+   if (start_reg > NUM_DATA_REGS)
+      return -1;
+   // Handle number of registers can be written to data register
+   if (num_regs > NUM_DATA_REGS - start_reg)
+   {
+      write_bytes = NUM_DATA_REGS - start_reg;
+      hw->status_regs[DEVICE_STATUS_REG] |= STS_DATAREGS_OVERFLOW_BIT;
+   }
+   // Update data from data register to kernel buffer
+   memcpy(hw->data_regs + start_reg,kbuf, write_bytes);
+   //printk("data in data register %s\n",hw->data_regs + start_reg);
+   // Update number writing
+   hw->status_regs[WRITE_COUNT_L_REG] += 1;
+   if(hw->status_regs[WRITE_COUNT_L_REG] == 0)
+      hw->status_regs[WRITE_COUNT_H_REG] += 1;
+   return write_bytes; 
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_write_data);
+
+int rchar_hw_clear(raspchar_dev_t *hw)
+{
+   if((hw->control_regs[CONTROL_ACCESS_REG] & CTRL_WRITE_DATA_BIT) == DISABLE)
+      return -1;
+   memset(hw->data_regs, 0, NUM_DATA_REGS * REG_SIZE);
+   hw->status_regs[DEVICE_STATUS_REG] &= ~STS_DATAREGS_OVERFLOW_BIT;
+   return 0;
+}
+EXPORT_SYMBOL_GPL(rchar_hw_clear);
+
+void rchar_hw_get_status(raspchar_dev_t *hw, sts_reg_t *status)
+{
+   memcpy(status, hw->status_regs, NUM_STS_REGS * REG_SIZE);
+}
+EXPORT_SYMBOL_GPL(rchar_hw_get_status);
+
+void vchar_hw_enable_read(raspchar_dev_t *hw, unsigned char isEnable)
+{
+   if(isEnable == ENABLE)
+   {
+      // Enable bit inform that data is ready read
+      hw->status_regs[DEVICE_STATUS_REG] |= STS_READ_ACCESS_BIT;
+      // Enable bit give the permit reading
+      hw->control_regs[CONTROL_ACCESS_REG] |= CTRL_READ_DATA_BIT;
+   }
+   else
+   {
+      // Disable bit inform that data is ready read
+      hw->status_regs[DEVICE_STATUS_REG] &= ~STS_READ_ACCESS_BIT;
+      // Disable bit give the permit reading
+      hw->control_regs[CONTROL_ACCESS_REG] &= ~CTRL_READ_DATA_BIT;
+   }
+}
+EXPORT_SYMBOL_GPL(vchar_hw_enable_read);
+
+void vchar_hw_enable_write(raspchar_dev_t *hw, unsigned char isEnable)
+{
+   if(isEnable == ENABLE)
+   {
+      // Enable bit inform that data is ready written
+      hw->status_regs[DEVICE_STATUS_REG] |= STS_WRITE_ACCESS_BIT;
+      // Enable bit give the permit write
+      hw->control_regs[CONTROL_ACCESS_REG] |= CTRL_WRITE_DATA_BIT;
+   }
+   else
+   {
+      // Disable bit inform that data is ready written
+      hw->status_regs[DEVICE_STATUS_REG] &= ~STS_WRITE_ACCESS_BIT;
+      // Disable bit give the permit writing
+      hw->control_regs[CONTROL_ACCESS_REG] &= ~CTRL_WRITE_DATA_BIT;
+   }
+}
+EXPORT_SYMBOL_GPL(vchar_hw_enable_write);
+
+/********************************** Sharded mode ***********************************/
+int raspchar_hw_shard_init(raspchar_dev_t *hw)
+{
+   struct raspchar_shard *shard;
+   int cpu;
+
+   hw->shards = alloc_percpu(struct raspchar_shard);
+   if (!hw->shards)
+      return -ENOMEM;
+   for_each_possible_cpu(cpu) {
+      shard = per_cpu_ptr(hw->shards, cpu);
+      seqcount_init(&shard->seq);
+   }
+   // the shards are zeroed: generation 0 is never current, unwritten registers read as 0
+   atomic_set(&hw->clear_gen, 1);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_shard_init);
+
+void raspchar_hw_shard_exit(raspchar_dev_t *hw)
+{
+   free_percpu(hw->shards);
+   hw->shards = NULL;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_shard_exit);
+
+/* Same checks and result as raspchar_hw_write_data, on the shard of the current CPU */
+int raspchar_hw_shard_write_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf)
+{
+   struct raspchar_shard *shard;
+   int write_bytes = num_regs;
+   u64 stamp;
+   u32 gen;
+   int i;
+
+   if ((READ_ONCE(hw->control_regs[CONTROL_ACCESS_REG]) & CTRL_WRITE_DATA_BIT) == DISABLE)
+      return -1;
+   if (kbuf == NULL)
+      return -1;
+   if (start_reg > NUM_DATA_REGS)
+      return -1;
+   if (num_regs > NUM_DATA_REGS - start_reg)
+      write_bytes = NUM_DATA_REGS - start_reg;
+
+   shard = get_cpu_ptr(hw->shards);
+   stamp = local_clock();
+   gen = atomic_read(&hw->clear_gen);
+   write_seqcount_begin(&shard->seq);
+   memcpy(shard->data_regs + start_reg, kbuf, write_bytes);
+   for (i = 0; i < write_bytes; i++) {
+      shard->stamps[start_reg + i] = stamp;
+      shard->gens[start_reg + i] = gen;
+   }
+   if (write_bytes < num_regs)
+      shard->overflow_gen = gen;
+   shard->write_count++;
+   write_seqcount_end(&shard->seq);
+   put_cpu_ptr(hw->shards);
+   return write_bytes;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_shard_write_data);
+
+/* Merge the shards: each register takes the value of its latest write of the current clear generation */
+int raspchar_hw_shard_read_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf)
+{
+   struct raspchar_shard *shard, *own;
+   int read_bytes = num_regs;
+   // one chunk of registers at a time, so the copies fit on the stack and read() never allocates
+   u64 best[RASPCHAR_MERGE_CHUNK], stamps[RASPCHAR_MERGE_CHUNK];
+   u32 gens[RASPCHAR_MERGE_CHUNK], gen;
+   unsigned char data[RASPCHAR_MERGE_CHUNK];
+   unsigned int seq;
+   int cpu, i, first, n;
+
+   if ((READ_ONCE(hw->control_regs[CONTROL_ACCESS_REG]) & CTRL_READ_DATA_BIT) == DISABLE)
+      return -1;
+   if (kbuf == NULL)
+      return -1;
+   if (start_reg > NUM_DATA_REGS)
+      return -1;
+   if (num_regs > (NUM_DATA_REGS - start_reg))
+      read_bytes = NUM_DATA_REGS - start_reg;
+
+   gen = atomic_read(&hw->clear_gen);
+   memset(kbuf, 0, read_bytes);
+   for (first = 0; first < read_bytes; first += n) {
+      n = min_t(int, read_bytes - first, RASPCHAR_MERGE_CHUNK);
+      memset(best, 0, sizeof(best));
+      for_each_possible_cpu(cpu) {
+         shard = per_cpu_ptr(hw->shards, cpu);
+         // a consistent copy of the stamps, generations and data of the chunk in one shard
+         do {
+            seq = read_seqcount_begin(&shard->seq);
+            memcpy(stamps, shard->stamps + start_reg + first, n * sizeof(u64));
+            memcpy(gens, shard->gens + start_reg + first, n * sizeof(u32));
+            memcpy(data, shard->data_regs + start_reg + first, n);
+         } while (read_seqcount_retry(&shard->seq, seq));
+         // stamps are only compared between writes of the same generation
+         for (i = 0; i < n; i++) {
+            if (gens[i] == gen && stamps[i] >= best[i]) {
+               best[i] = stamps[i];
+               kbuf[first + i] = data[i];
+            }
+         }
+      }
+   }
+
+   own = get_cpu_ptr(hw->shards);
+   write_seqcount_begin(&own->seq);
+   own->read_count++;
+   write_seqcount_end(&own->seq);
+   put_cpu_ptr(hw->shards);
+   return read_bytes;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_shard_read_data);
+
+/* Registers written before now read as 0, no shard is touched: the writes of the older generations are ignored */
+int raspchar_hw_shard_clear(raspchar_dev_t *hw)
+{
+   if ((READ_ONCE(hw->control_regs[CONTROL_ACCESS_REG]) & CTRL_WRITE_DATA_BIT) == DISABLE)
+      return -1;
+   atomic_inc(&hw->clear_gen);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_shard_clear);
+
+/* Status of the whole device: counters summed over the shards, overflow if any shard overflowed since the last clear */
+void raspchar_hw_shard_get_status(raspchar_dev_t *hw, sts_reg_t *status)
+{
+   struct raspchar_shard *shard;
+   u32 read_count = 0, write_count = 0;
+   u32 gen = atomic_read(&hw->clear_gen);
+   unsigned char device_status = hw->status_regs[DEVICE_STATUS_REG] & ~STS_DATAREGS_OVERFLOW_BIT;
+   int cpu;
+
+   for_each_possible_cpu(cpu) {
+      shard = per_cpu_ptr(hw->shards, cpu);
+      read_count += READ_ONCE(shard->read_count);
+      write_count += READ_ONCE(shard->write_count);
+      if (READ_ONCE(shard->overflow_gen) == gen)
+         device_status |= STS_DATAREGS_OVERFLOW_BIT;
+   }
+   // the registers keep the low 16 bits, as in the main bank
+   status->read_count_h_reg = read_count >> 8;
+   status->read_count_l_reg = read_count;
+   status->write_count_h_reg = write_count >> 8;
+   status->write_count_l_reg = write_count;
+   status->device_status_reg = device_status;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_shard_get_status);
+
+/* Successful writes on all the CPUs, only the shards are read */
+u64 raspchar_hw_shard_write_seq(raspchar_dev_t *hw)
+{
+   u64 write_count = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      write_count += READ_ONCE(per_cpu_ptr(hw->shards, cpu)->write_count);
+   return write_count;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_shard_write_seq);
+
+/********************************** Banked mode ***********************************/
+int raspchar_hw_bank_init(raspchar_dev_t *hw)
+{
+   struct raspchar_frame *frame;
+
+   // the initial front frame is the content of the registers, all 0
+   frame = kzalloc(sizeof(*frame), GFP_KERNEL);
+   if (!frame)
+      return -ENOMEM;
+   hw->bank_reads = alloc_percpu(u32);
+   if (!hw->bank_reads) {
+      kfree(frame);
+      return -ENOMEM;
+   }
+   spin_lock_init(&hw->back_lock);
+   RCU_INIT_POINTER(hw->front, frame);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_bank_init);
+
+/* No reader is left when the device is removed */
+void raspchar_hw_bank_exit(raspchar_dev_t *hw)
+{
+   kfree(rcu_dereference_protected(hw->front, 1));
+   RCU_INIT_POINTER(hw->front, NULL);
+   free_percpu(hw->bank_reads);
+   hw->bank_reads = NULL;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_bank_exit);
+
+/* Same checks and result as raspchar_hw_read_data, on the front frame */
+int raspchar_hw_bank_read_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf)
+{
+   struct raspchar_frame *frame;
+   int read_bytes = num_regs;
+
+   if ((READ_ONCE(hw->control_regs[CONTROL_ACCESS_REG]) & CTRL_READ_DATA_BIT) == DISABLE)
+      return -1;
+   if (kbuf == NULL)
+      return -1;
+   if (start_reg > NUM_DATA_REGS)
+      return -1;
+   if (num_regs > (NUM_DATA_REGS - start_reg))
+      read_bytes = NUM_DATA_REGS - start_reg;
+
+   rcu_read_lock();
+   frame = rcu_dereference(hw->front);
+   memcpy(kbuf, frame->data_regs + start_reg, read_bytes);
+   rcu_read_unlock();
+
+   // the read count is only assembled into the status registers by raspchar_hw_bank_get_status
+   this_cpu_inc(*hw->bank_reads);
+   return read_bytes;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_bank_read_data);
+
+/* Writes go to the back buffer, they are seen by the readers at the next commit */
+int raspchar_hw_bank_write_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf)
+{
+   int write_bytes;
+
+   spin_lock(&hw->back_lock);
+   write_bytes = raspchar_hw_write_data(hw, start_reg, num_regs, kbuf);
+   spin_unlock(&hw->back_lock);
+   return write_bytes;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_bank_write_data);
+
+/* Clear the back buffer, the front frame stays until the next commit */
+int raspchar_hw_bank_clear(raspchar_dev_t *hw)
+{
+   int ret;
+
+   spin_lock(&hw->back_lock);
+   ret = rchar_hw_clear(hw);
+   spin_unlock(&hw->back_lock);
+   return ret;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_bank_clear);
+
+/* Publish the back buffer as the new front frame, the old one is freed after the current readers */
+int raspchar_hw_bank_commit(raspchar_dev_t *hw)
+{
+   struct raspchar_frame *frame, *old;
+
+   if ((READ_ONCE(hw->control_regs[CONTROL_ACCESS_REG]) & CTRL_WRITE_DATA_BIT) == DISABLE)
+      return -1;
+   frame = kmalloc(sizeof(*frame), GFP_KERNEL);
+   if (!frame)
+      return -ENOMEM;
+
+   spin_lock(&hw->back_lock);
+   old = rcu_dereference_protected(hw->front, lockdep_is_held(&hw->back_lock));
+   memcpy(frame->data_regs, hw->data_regs, NUM_DATA_REGS);
+   frame->seq = old->seq + 1;
+   rcu_assign_pointer(hw->front, frame);
+   spin_unlock(&hw->back_lock);
+
+   kfree_rcu(old, rcu);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_bank_commit);
+
+/* Copy the whole front frame, return its sequence number */
+u64 raspchar_hw_bank_snapshot(raspchar_dev_t *hw, unsigned char *data_regs)
+{
+   struct raspchar_frame *frame;
+   u64 seq;
+
+   rcu_read_lock();
+   frame = rcu_dereference(hw->front);
+   memcpy(data_regs, frame->data_regs, NUM_DATA_REGS);
+   seq = frame->seq;
+   rcu_read_unlock();
+   return seq;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_bank_snapshot);
+
+/* Status of the main bank with the read counters of the front frame readers, summed over the CPUs */
+void raspchar_hw_bank_get_status(raspchar_dev_t *hw, sts_reg_t *status)
+{
+   unsigned int read_count = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      read_count += READ_ONCE(*per_cpu_ptr(hw->bank_reads, cpu));
+   spin_lock(&hw->back_lock);
+   rchar_hw_get_status(hw, status);
+   spin_unlock(&hw->back_lock);
+   // the registers keep the low 16 bits, as in the main bank
+   status->read_count_h_reg = read_count >> 8;
+   status->read_count_l_reg = read_count;
+}
+EXPORT_SYMBOL_GPL(raspchar_hw_bank_get_status);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("PHAM Minh Thuc");
+MODULE_DESCRIPTION("Register bank of the virtual raspchar device, shared by raspchar and its KUnit test");
@@ -0,0 +1,89 @@
+/**
+ * @file    raspchar_hw.h
+ * @author  PHAM Minh Thuc
+ * @brief   Hardware layer of the virtual raspchar device: the register bank on RAM and its operations.
+ * It does not depend on the char device, so it is tested alone by raspchar_hw_test.c
+*/
+#ifndef RASPCHAR_HW_H
+#define RASPCHAR_HW_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include "raspchar.h"
+#include "raspchar_ioctl.h"             // sts_reg_t
+
+/*
+ * Sharded mode: every CPU writes in its own copy of the data registers, so writers on different
+ * CPUs never share a cache line. The counters of a shard sit in their own cache line, away from
+ * the data. A read merges the shards: each register has the value of its latest write, on any
+ * CPU, ordered by local_clock(). A clear only increases the clear generation of the device: a
+ * write is tagged with the generation it was made in, and the merge and the overflow bit ignore
+ * the older generations. The clocks of the CPUs are not compared across a clear, they may drift.
+ * The control register stays in the main bank, it is only read by the I/O paths.
+ */
+#define RASPCHAR_MERGE_CHUNK 32                 // registers merged at a time by a sharded read, on the stack
+
+struct raspchar_shard {
+   seqcount_t seq;                              // written by the owner CPU only, preemption disabled
+   u32 read_count;
+   u64 write_count;                             // not wrapped, summed by raspchar_hw_shard_write_seq
+   u32 overflow_gen;                            // clear generation of the last write past the end
+   unsigned char data_regs[NUM_DATA_REGS] ____cacheline_aligned;
+   u64 stamps[NUM_DATA_REGS];                   // local_clock() of the last write of each register
+   u32 gens[NUM_DATA_REGS];                     // clear generation of the last write of each register
+} ____cacheline_aligned;
+
+/*
+ * Banked mode: write() fills the data registers of the main bank (the back buffer) and a commit
+ * publishes a copy of them as the front frame, by an RCU pointer swap. read() and the snapshot
+ * come from the front frame: they always see a complete frame and never block the writers.
+ */
+struct raspchar_frame {
+   struct rcu_head rcu;
+   u64 seq;                                     // number of commits before this frame, 0 for the initial one
+   unsigned char data_regs[NUM_DATA_REGS];
+};
+
+typedef struct raspchar_dev {
+   unsigned char * control_regs;
+   unsigned char * status_regs;
+   unsigned char * data_regs;
+   struct raspchar_shard __percpu *shards;      // NULL when the device is not sharded
+   atomic_t clear_gen;                          // sharded: writes of an older generation were cleared
+   struct raspchar_frame __rcu *front;          // NULL when the device is not banked
+   spinlock_t back_lock;                        // banked: serializes the writes, the commits and the write counter
+   u32 __percpu *bank_reads;                    // banked: read counters per CPU, readers share no line with back_lock or each other
+} raspchar_dev_t;
+
+int raspchar_hw_init(raspchar_dev_t *hw);
+void raspchar_hw_exit(raspchar_dev_t *hw);
+int raspchar_hw_read_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf);
+int raspchar_hw_write_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf);
+int rchar_hw_clear(raspchar_dev_t *hw);
+void rchar_hw_get_status(raspchar_dev_t *hw, sts_reg_t *status);
+void vchar_hw_enable_read(raspchar_dev_t *hw, unsigned char isEnable);
+void vchar_hw_enable_write(raspchar_dev_t *hw, unsigned char isEnable);
+
+int raspchar_hw_shard_init(raspchar_dev_t *hw);
+void raspchar_hw_shard_exit(raspchar_dev_t *hw);
+int raspchar_hw_shard_read_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf);
+int raspchar_hw_shard_write_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf);
+int raspchar_hw_shard_clear(raspchar_dev_t *hw);
+void raspchar_hw_shard_get_status(raspchar_dev_t *hw, sts_reg_t *status);
+u64 raspchar_hw_shard_write_seq(raspchar_dev_t *hw);
+
+int raspchar_hw_bank_init(raspchar_dev_t *hw);
+void raspchar_hw_bank_exit(raspchar_dev_t *hw);
+int raspchar_hw_bank_read_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf);
+int raspchar_hw_bank_write_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf);
+int raspchar_hw_bank_clear(raspchar_dev_t *hw);
+int raspchar_hw_bank_commit(raspchar_dev_t *hw);
+u64 raspchar_hw_bank_snapshot(raspchar_dev_t *hw, unsigned char *data_regs);
+void raspchar_hw_bank_get_status(raspchar_dev_t *hw, sts_reg_t *status);
+
+#endif
@@ -0,0 +1,628 @@
+/**
+ * @file    raspchar_hw_test.c
+ * @author  PHAM Minh Thuc
+ * @brief   KUnit tests of the raspchar hardware layer, plus microbenchmarks of the read/write paths.
+ * The tests pin the current behavior at the boundaries of the data registers:
+ *    - start_reg == NUM_DATA_REGS is accepted (the check is '>' not '>='): a read returns 0 bytes,
+ *      a write stores nothing but sets the overflow bit. Both are counted in the status registers
+ *    - start_reg > NUM_DATA_REGS is refused with -1 and nothing is counted
+ * Run on UML from a kernel tree where this directory is copied (ex. drivers/misc/raspchar):
+ *    ./tools/testing/kunit/kunit.py run --kunitconfig=drivers/misc/raspchar
+*/
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include "raspchar_hw.h"
+
+#define BENCH_OPS 100000                // operations timed per transfer size
+
+static unsigned int read_count(raspchar_dev_t *hw)
+{
+   return hw->status_regs[READ_COUNT_H_REG] << 8 | hw->status_regs[READ_COUNT_L_REG];
+}
+
+static unsigned int write_count(raspchar_dev_t *hw)
+{
+   return hw->status_regs[WRITE_COUNT_H_REG] << 8 | hw->status_regs[WRITE_COUNT_L_REG];
+}
+
+static bool overflow(raspchar_dev_t *hw)
+{
+   return hw->status_regs[DEVICE_STATUS_REG] & STS_DATAREGS_OVERFLOW_BIT;
+}
+
+static int raspchar_hw_test_init(struct kunit *test)
+{
+   raspchar_dev_t *hw = kunit_kzalloc(test, sizeof(*hw), GFP_KERNEL);
+
+   KUNIT_ASSERT_NOT_ERR_OR_NULL(test, hw);
+   KUNIT_ASSERT_EQ(test, raspchar_hw_init(hw), 0);
+   test->priv = hw;
+   return 0;
+}
+
+static void raspchar_hw_test_exit(struct kunit *test)
+{
+   raspchar_hw_exit(test->priv);
+}
+
+// fill the data registers with their index, through the hw layer
+static void fill_data(struct kunit *test, raspchar_dev_t *hw)
+{
+   char buf[NUM_DATA_REGS];
+   int i;
+
+   for (i = 0; i < NUM_DATA_REGS; i++)
+      buf[i] = i;
+   KUNIT_ASSERT_EQ(test, raspchar_hw_write_data(hw, 0, NUM_DATA_REGS, buf), NUM_DATA_REGS);
+}
+
+/********************************** Correctness ***********************************/
+static void raspchar_hw_test_initial_state(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   int i;
+
+   KUNIT_EXPECT_PTR_EQ(test, hw->status_regs, hw->control_regs + NUM_CTRL_REGS);
+   KUNIT_EXPECT_PTR_EQ(test, hw->data_regs, hw->status_regs + NUM_STS_REGS);
+   KUNIT_EXPECT_EQ(test, (int)hw->control_regs[CONTROL_ACCESS_REG], CTRL_READ_DATA_BIT | CTRL_WRITE_DATA_BIT);
+   KUNIT_EXPECT_EQ(test, (int)hw->status_regs[DEVICE_STATUS_REG], STS_READ_ACCESS_BIT | STS_WRITE_ACCESS_BIT);
+   KUNIT_EXPECT_EQ(test, read_count(hw), 0u);
+   KUNIT_EXPECT_EQ(test, write_count(hw), 0u);
+   for (i = 0; i < NUM_DATA_REGS; i++)
+      KUNIT_EXPECT_EQ(test, (int)hw->data_regs[i], 0);
+}
+
+static void raspchar_hw_test_read_all(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[NUM_DATA_REGS + 1];
+   int i;
+
+   fill_data(test, hw);
+   // asking more than the bank gives the whole bank
+   KUNIT_EXPECT_EQ(test, raspchar_hw_read_data(hw, 0, NUM_DATA_REGS + 1, buf), NUM_DATA_REGS);
+   for (i = 0; i < NUM_DATA_REGS; i++)
+      KUNIT_EXPECT_EQ(test, (int)(unsigned char)buf[i], i);
+   KUNIT_EXPECT_EQ(test, read_count(hw), 1u);
+}
+
+static void raspchar_hw_test_read_truncated(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[16];
+
+   fill_data(test, hw);
+   // more than the registers left: truncated to the end of the bank
+   KUNIT_EXPECT_EQ(test, raspchar_hw_read_data(hw, NUM_DATA_REGS - 1, sizeof(buf), buf), 1);
+   KUNIT_EXPECT_EQ(test, (int)(unsigned char)buf[0], NUM_DATA_REGS - 1);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_read_data(hw, NUM_DATA_REGS - 10, 10, buf), 10);
+   KUNIT_EXPECT_EQ(test, (int)(unsigned char)buf[9], NUM_DATA_REGS - 1);
+}
+
+static void raspchar_hw_test_read_end(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[4];
+
+   // the end of the bank is accepted: end of file, but still counted as a read
+   KUNIT_EXPECT_EQ(test, raspchar_hw_read_data(hw, NUM_DATA_REGS, sizeof(buf), buf), 0);
+   KUNIT_EXPECT_EQ(test, read_count(hw), 1u);
+   // past the end is refused and not counted
+   KUNIT_EXPECT_EQ(test, raspchar_hw_read_data(hw, NUM_DATA_REGS + 1, sizeof(buf), buf), -1);
+   KUNIT_EXPECT_EQ(test, read_count(hw), 1u);
+}
+
+static void raspchar_hw_test_read_refused(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[4];
+
+   KUNIT_EXPECT_EQ(test, raspchar_hw_read_data(hw, 0, sizeof(buf), NULL), -1);
+   vchar_hw_enable_read(hw, DISABLE);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_read_data(hw, 0, sizeof(buf), buf), -1);
+   KUNIT_EXPECT_EQ(test, read_count(hw), 0u);
+   vchar_hw_enable_read(hw, ENABLE);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_read_data(hw, 0, sizeof(buf), buf), (int)sizeof(buf));
+}
+
+static void raspchar_hw_test_write_all(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   int i;
+
+   fill_data(test, hw);
+   for (i = 0; i < NUM_DATA_REGS; i++)
+      KUNIT_EXPECT_EQ(test, (int)hw->data_regs[i], i);
+   KUNIT_EXPECT_EQ(test, write_count(hw), 1u);
+   // exactly the size of the bank is not an overflow
+   KUNIT_EXPECT_FALSE(test, overflow(hw));
+   // the status registers just before the data are untouched
+   KUNIT_EXPECT_EQ(test, (int)hw->status_regs[DEVICE_STATUS_REG], STS_READ_ACCESS_BIT | STS_WRITE_ACCESS_BIT);
+}
+
+static void raspchar_hw_test_write_overflow(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[10];
+
+   memset(buf, 0xaa, sizeof(buf));
+   KUNIT_EXPECT_EQ(test, raspchar_hw_write_data(hw, NUM_DATA_REGS - 6, sizeof(buf), buf), 6);
+   KUNIT_EXPECT_TRUE(test, overflow(hw));
+   KUNIT_EXPECT_EQ(test, (int)hw->data_regs[NUM_DATA_REGS - 7], 0);
+   KUNIT_EXPECT_EQ(test, (int)hw->data_regs[NUM_DATA_REGS - 6], 0xaa);
+   KUNIT_EXPECT_EQ(test, (int)hw->data_regs[NUM_DATA_REGS - 1], 0xaa);
+   KUNIT_EXPECT_EQ(test, write_count(hw), 1u);
+}
+
+static void raspchar_hw_test_write_end(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[4] = { 1, 2, 3, 4 };
+
+   // the end of the bank is accepted: nothing is stored, but it is an overflow and it is counted
+   KUNIT_EXPECT_EQ(test, raspchar_hw_write_data(hw, NUM_DATA_REGS, sizeof(buf), buf), 0);
+   KUNIT_EXPECT_TRUE(test, overflow(hw));
+   KUNIT_EXPECT_EQ(test, write_count(hw), 1u);
+   // past the end is refused and not counted
+   KUNIT_EXPECT_EQ(test, raspchar_hw_write_data(hw, NUM_DATA_REGS + 1, sizeof(buf), buf), -1);
+   KUNIT_EXPECT_EQ(test, write_count(hw), 1u);
+}
+
+static void raspchar_hw_test_write_empty(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[1];
+
+   // an empty write is counted and never an overflow
+   KUNIT_EXPECT_EQ(test, raspchar_hw_write_data(hw, 0, 0, buf), 0);
+   KUNIT_EXPECT_EQ(test, write_count(hw), 1u);
+   KUNIT_EXPECT_FALSE(test, overflow(hw));
+}
+
+static void raspchar_hw_test_write_refused(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[4] = { 1, 2, 3, 4 };
+
+   KUNIT_EXPECT_EQ(test, raspchar_hw_write_data(hw, 0, sizeof(buf), NULL), -1);
+   vchar_hw_enable_write(hw, DISABLE);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_write_data(hw, 0, sizeof(buf), buf), -1);
+   KUNIT_EXPECT_EQ(test, (int)hw->data_regs[0], 0);
+   KUNIT_EXPECT_EQ(test, write_count(hw), 0u);
+}
+
+static void raspchar_hw_test_count_carry(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[1];
+   int i;
+
+   // the low byte wraps into the high byte, then the 16 bits counter wraps to 0
+   for (i = 0; i < 256; i++) {
+      raspchar_hw_read_data(hw, 0, 1, buf);
+      raspchar_hw_write_data(hw, 0, 1, buf);
+   }
+   KUNIT_EXPECT_EQ(test, (int)hw->status_regs[READ_COUNT_H_REG], 1);
+   KUNIT_EXPECT_EQ(test, (int)hw->status_regs[READ_COUNT_L_REG], 0);
+   KUNIT_EXPECT_EQ(test, write_count(hw), 256u);
+   for (i = 256; i < 65536; i++)
+      raspchar_hw_read_data(hw, 0, 1, buf);
+   KUNIT_EXPECT_EQ(test, read_count(hw), 0u);
+}
+
+static void raspchar_hw_test_clear(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[10];
+   int i;
+
+   fill_data(test, hw);
+   raspchar_hw_write_data(hw, NUM_DATA_REGS - 1, sizeof(buf), buf);
+   KUNIT_ASSERT_TRUE(test, overflow(hw));
+
+   KUNIT_EXPECT_EQ(test, rchar_hw_clear(hw), 0);
+   for (i = 0; i < NUM_DATA_REGS; i++)
+      KUNIT_EXPECT_EQ(test, (int)hw->data_regs[i], 0);
+   KUNIT_EXPECT_FALSE(test, overflow(hw));
+   // the counters are not cleared
+   KUNIT_EXPECT_EQ(test, write_count(hw), 2u);
+
+   // clear needs the write permission
+   fill_data(test, hw);
+   vchar_hw_enable_write(hw, DISABLE);
+   KUNIT_EXPECT_EQ(test, rchar_hw_clear(hw), -1);
+   KUNIT_EXPECT_EQ(test, (int)hw->data_regs[1], 1);
+}
+
+static void raspchar_hw_test_get_status(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   sts_reg_t status;
+   char buf[NUM_DATA_REGS + 1] = { 0 };
+
+   raspchar_hw_read_data(hw, 0, 1, buf);
+   raspchar_hw_write_data(hw, 0, sizeof(buf), buf);
+   raspchar_hw_write_data(hw, 0, 1, buf);
+   rchar_hw_get_status(hw, &status);
+   KUNIT_EXPECT_EQ(test, (int)status.read_count_h_reg, 0);
+   KUNIT_EXPECT_EQ(test, (int)status.read_count_l_reg, 1);
+   KUNIT_EXPECT_EQ(test, (int)status.write_count_h_reg, 0);
+   KUNIT_EXPECT_EQ(test, (int)status.write_count_l_reg, 2);
+   KUNIT_EXPECT_EQ(test, (int)status.device_status_reg, STS_READ_ACCESS_BIT | STS_WRITE_ACCESS_BIT | STS_DATAREGS_OVERFLOW_BIT);
+}
+
+static void raspchar_hw_test_enable(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+
+   vchar_hw_enable_read(hw, DISABLE);
+   KUNIT_EXPECT_EQ(test, (int)hw->control_regs[CONTROL_ACCESS_REG], CTRL_WRITE_DATA_BIT);
+   KUNIT_EXPECT_EQ(test, (int)hw->status_regs[DEVICE_STATUS_REG], STS_WRITE_ACCESS_BIT);
+   vchar_hw_enable_write(hw, DISABLE);
+   KUNIT_EXPECT_EQ(test, (int)hw->control_regs[CONTROL_ACCESS_REG], 0);
+   KUNIT_EXPECT_EQ(test, (int)hw->status_regs[DEVICE_STATUS_REG], 0);
+   vchar_hw_enable_read(hw, ENABLE);
+   vchar_hw_enable_write(hw, ENABLE);
+   KUNIT_EXPECT_EQ(test, (int)hw->control_regs[CONTROL_ACCESS_REG], CTRL_READ_DATA_BIT | CTRL_WRITE_DATA_BIT);
+   KUNIT_EXPECT_EQ(test, (int)hw->status_regs[DEVICE_STATUS_REG], STS_READ_ACCESS_BIT | STS_WRITE_ACCESS_BIT);
+   // any value other than ENABLE disables
+   vchar_hw_enable_read(hw, 2);
+   KUNIT_EXPECT_EQ(test, (int)hw->control_regs[CONTROL_ACCESS_REG], CTRL_WRITE_DATA_BIT);
+}
+
+static struct kunit_case raspchar_hw_test_cases[] = {
+   KUNIT_CASE(raspchar_hw_test_initial_state),
+   KUNIT_CASE(raspchar_hw_test_read_all),
+   KUNIT_CASE(raspchar_hw_test_read_truncated),
+   KUNIT_CASE(raspchar_hw_test_read_end),
+   KUNIT_CASE(raspchar_hw_test_read_refused),
+   KUNIT_CASE(raspchar_hw_test_write_all),
+   KUNIT_CASE(raspchar_hw_test_write_overflow),
+   KUNIT_CASE(raspchar_hw_test_write_end),
+   KUNIT_CASE(raspchar_hw_test_write_empty),
+   KUNIT_CASE(raspchar_hw_test_write_refused),
+   KUNIT_CASE(raspchar_hw_test_count_carry),
+   KUNIT_CASE(raspchar_hw_test_clear),
+   KUNIT_CASE(raspchar_hw_test_get_status),
+   KUNIT_CASE(raspchar_hw_test_enable),
+   {}
+};
+
+static struct kunit_suite raspchar_hw_test_suite = {
+   .name = "raspchar_hw",
+   .init = raspchar_hw_test_init,
+   .exit = raspchar_hw_test_exit,
+   .test_cases = raspchar_hw_test_cases,
+};
+
+/********************************** Sharded mode ***********************************/
+static int raspchar_hw_shard_test_init(struct kunit *test)
+{
+   raspchar_hw_test_init(test);
+   KUNIT_ASSERT_EQ(test, raspchar_hw_shard_init(test->priv), 0);
+   return 0;
+}
+
+static void raspchar_hw_shard_test_merge(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char a[4] = { 1, 1, 1, 1 }, b[4] = { 2, 2, 2, 2 }, buf[8];
+
+   // never written registers read as 0, the latest write wins
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_write_data(hw, 0, sizeof(a), a), 4);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_write_data(hw, 2, sizeof(b), b), 4);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_read_data(hw, 0, sizeof(buf), buf), 8);
+   KUNIT_EXPECT_EQ(test, (int)buf[1], 1);
+   KUNIT_EXPECT_EQ(test, (int)buf[2], 2);
+   KUNIT_EXPECT_EQ(test, (int)buf[5], 2);
+   KUNIT_EXPECT_EQ(test, (int)buf[6], 0);
+   // the main bank is not used
+   KUNIT_EXPECT_EQ(test, (int)hw->data_regs[0], 0);
+}
+
+static void raspchar_hw_shard_test_boundaries(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[10] = { 0 };
+   sts_reg_t status;
+
+   // same results as the main bank
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_read_data(hw, NUM_DATA_REGS, sizeof(buf), buf), 0);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_read_data(hw, NUM_DATA_REGS + 1, sizeof(buf), buf), -1);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_read_data(hw, 0, sizeof(buf), NULL), -1);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_write_data(hw, NUM_DATA_REGS - 6, sizeof(buf), buf), 6);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_write_data(hw, NUM_DATA_REGS + 1, sizeof(buf), buf), -1);
+   vchar_hw_enable_write(hw, DISABLE);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_write_data(hw, 0, sizeof(buf), buf), -1);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_clear(hw), -1);
+
+   raspchar_hw_shard_get_status(hw, &status);
+   KUNIT_EXPECT_EQ(test, (int)status.read_count_l_reg, 1);
+   KUNIT_EXPECT_EQ(test, (int)status.write_count_l_reg, 1);
+   KUNIT_EXPECT_EQ(test, (int)status.device_status_reg, STS_READ_ACCESS_BIT | STS_DATAREGS_OVERFLOW_BIT);
+}
+
+static void raspchar_hw_shard_test_clear(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[NUM_DATA_REGS + 1];
+   sts_reg_t status;
+   int i;
+
+   memset(buf, 0x33, sizeof(buf));
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_write_data(hw, 0, sizeof(buf), buf), NUM_DATA_REGS);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_clear(hw), 0);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_read_data(hw, 0, NUM_DATA_REGS, buf), NUM_DATA_REGS);
+   for (i = 0; i < NUM_DATA_REGS; i++)
+      KUNIT_EXPECT_EQ(test, (int)buf[i], 0);
+   raspchar_hw_shard_get_status(hw, &status);
+   KUNIT_EXPECT_EQ(test, (int)status.device_status_reg, STS_READ_ACCESS_BIT | STS_WRITE_ACCESS_BIT);
+   KUNIT_EXPECT_EQ(test, (int)status.write_count_l_reg, 1);
+
+   // a write after the clear is seen again
+   buf[0] = 7;
+   raspchar_hw_shard_write_data(hw, 10, 1, buf);
+   raspchar_hw_shard_read_data(hw, 10, 1, buf);
+   KUNIT_EXPECT_EQ(test, (int)buf[0], 7);
+}
+
+static void raspchar_hw_shard_test_clear_clock_skew(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   struct raspchar_shard *shard;
+   char buf[NUM_DATA_REGS + 1];
+   sts_reg_t status;
+   int cpu;
+
+   // writes from a CPU whose clock runs ahead of the one of the clear, modeled by stamps in the future
+   memset(buf, 0x44, sizeof(buf));
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_write_data(hw, 0, sizeof(buf), buf), NUM_DATA_REGS);
+   for_each_possible_cpu(cpu) {
+      shard = per_cpu_ptr(hw->shards, cpu);
+      memset(shard->stamps, 0xff, sizeof(shard->stamps));
+   }
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_clear(hw), 0);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_read_data(hw, 0, 4, buf), 4);
+   KUNIT_EXPECT_EQ(test, (int)buf[0], 0);
+   KUNIT_EXPECT_EQ(test, (int)buf[3], 0);
+   raspchar_hw_shard_get_status(hw, &status);
+   KUNIT_EXPECT_EQ(test, (int)(status.device_status_reg & STS_DATAREGS_OVERFLOW_BIT), 0);
+
+   // a write after the clear wins over them whatever its stamp
+   buf[0] = 9;
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_write_data(hw, 3, 1, buf), 1);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_shard_read_data(hw, 3, 1, buf), 1);
+   KUNIT_EXPECT_EQ(test, (int)buf[0], 9);
+}
+
+static void raspchar_hw_shard_test_count_carry(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   sts_reg_t status;
+   char buf[1] = { 0 };
+   int i;
+
+   for (i = 0; i < 300; i++)
+      raspchar_hw_shard_write_data(hw, 0, 1, buf);
+   raspchar_hw_shard_get_status(hw, &status);
+   KUNIT_EXPECT_EQ(test, (int)status.write_count_h_reg, 1);
+   KUNIT_EXPECT_EQ(test, (int)status.write_count_l_reg, 300 - 256);
+}
+
+static struct kunit_case raspchar_hw_shard_test_cases[] = {
+   KUNIT_CASE(raspchar_hw_shard_test_merge),
+   KUNIT_CASE(raspchar_hw_shard_test_boundaries),
+   KUNIT_CASE(raspchar_hw_shard_test_clear),
+   KUNIT_CASE(raspchar_hw_shard_test_clear_clock_skew),
+   KUNIT_CASE(raspchar_hw_shard_test_count_carry),
+   {}
+};
+
+static struct kunit_suite raspchar_hw_shard_test_suite = {
+   .name = "raspchar_hw_shard",
+   .init = raspchar_hw_shard_test_init,
+   .exit = raspchar_hw_test_exit,
+   .test_cases = raspchar_hw_shard_test_cases,
+};
+
+/********************************** Banked mode ***********************************/
+static int raspchar_hw_bank_test_init(struct kunit *test)
+{
+   raspchar_hw_test_init(test);
+   KUNIT_ASSERT_EQ(test, raspchar_hw_bank_init(test->priv), 0);
+   return 0;
+}
+
+static void raspchar_hw_bank_test_commit(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   unsigned char frame[NUM_DATA_REGS];
+   char buf[NUM_DATA_REGS];
+
+   memset(buf, 0x11, sizeof(buf));
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_write_data(hw, 0, sizeof(buf), buf), NUM_DATA_REGS);
+   // not published yet: the readers still see the initial frame
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_read_data(hw, 0, 4, buf), 4);
+   KUNIT_EXPECT_EQ(test, (int)buf[0], 0);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_snapshot(hw, frame), 0ull);
+
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_commit(hw), 0);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_snapshot(hw, frame), 1ull);
+   KUNIT_EXPECT_EQ(test, (int)frame[NUM_DATA_REGS - 1], 0x11);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_read_data(hw, NUM_DATA_REGS - 4, 8, buf), 4);
+   KUNIT_EXPECT_EQ(test, (int)buf[3], 0x11);
+   KUNIT_EXPECT_EQ(test, read_count(hw), 2u);
+}
+
+static void raspchar_hw_bank_test_partial_frame(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   unsigned char frame[NUM_DATA_REGS];
+   char a[128], b[128];
+
+   // a frame written in two parts is seen whole or not at all
+   memset(a, 1, sizeof(a));
+   memset(b, 2, sizeof(b));
+   raspchar_hw_bank_write_data(hw, 0, sizeof(a), a);
+   raspchar_hw_bank_commit(hw);
+   raspchar_hw_bank_write_data(hw, 0, sizeof(b), b);
+   raspchar_hw_bank_snapshot(hw, frame);
+   KUNIT_EXPECT_EQ(test, (int)frame[0], 1);
+   raspchar_hw_bank_write_data(hw, sizeof(b), sizeof(b), b);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_commit(hw), 0);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_snapshot(hw, frame), 2ull);
+   KUNIT_EXPECT_EQ(test, (int)frame[0], 2);
+   KUNIT_EXPECT_EQ(test, (int)frame[NUM_DATA_REGS - 1], 2);
+}
+
+static void raspchar_hw_bank_test_clear(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   unsigned char frame[NUM_DATA_REGS];
+   char buf[4] = { 5, 5, 5, 5 };
+
+   raspchar_hw_bank_write_data(hw, 0, sizeof(buf), buf);
+   raspchar_hw_bank_commit(hw);
+   // clear empties the back buffer only
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_clear(hw), 0);
+   raspchar_hw_bank_snapshot(hw, frame);
+   KUNIT_EXPECT_EQ(test, (int)frame[0], 5);
+   raspchar_hw_bank_commit(hw);
+   raspchar_hw_bank_snapshot(hw, frame);
+   KUNIT_EXPECT_EQ(test, (int)frame[0], 0);
+}
+
+static void raspchar_hw_bank_test_read_count(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[4] = { 0 };
+   sts_reg_t status;
+   int i;
+
+   // reads are counted apart from the back buffer and only assembled by the status
+   for (i = 0; i < 300; i++)
+      raspchar_hw_bank_read_data(hw, 0, sizeof(buf), buf);
+   raspchar_hw_bank_write_data(hw, 0, sizeof(buf), buf);
+   KUNIT_EXPECT_EQ(test, read_count(hw), 0u);
+   raspchar_hw_bank_get_status(hw, &status);
+   KUNIT_EXPECT_EQ(test, (int)status.read_count_h_reg, 1);
+   KUNIT_EXPECT_EQ(test, (int)status.read_count_l_reg, 300 - 256);
+   KUNIT_EXPECT_EQ(test, (int)status.write_count_l_reg, 1);
+}
+
+static void raspchar_hw_bank_test_boundaries(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[4] = { 0 };
+
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_read_data(hw, NUM_DATA_REGS, sizeof(buf), buf), 0);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_read_data(hw, NUM_DATA_REGS + 1, sizeof(buf), buf), -1);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_write_data(hw, NUM_DATA_REGS, sizeof(buf), buf), 0);
+   KUNIT_EXPECT_TRUE(test, overflow(hw));
+   vchar_hw_enable_read(hw, DISABLE);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_read_data(hw, 0, sizeof(buf), buf), -1);
+   vchar_hw_enable_write(hw, DISABLE);
+   KUNIT_EXPECT_EQ(test, raspchar_hw_bank_commit(hw), -1);
+}
+
+static struct kunit_case raspchar_hw_bank_test_cases[] = {
+   KUNIT_CASE(raspchar_hw_bank_test_commit),
+   KUNIT_CASE(raspchar_hw_bank_test_partial_frame),
+   KUNIT_CASE(raspchar_hw_bank_test_clear),
+   KUNIT_CASE(raspchar_hw_bank_test_read_count),
+   KUNIT_CASE(raspchar_hw_bank_test_boundaries),
+   {}
+};
+
+static struct kunit_suite raspchar_hw_bank_test_suite = {
+   .name = "raspchar_hw_bank",
+   .init = raspchar_hw_bank_test_init,
+   .exit = raspchar_hw_test_exit,
+   .test_cases = raspchar_hw_bank_test_cases,
+};
+
+/********************************** Microbenchmarks ***********************************/
+/*
+ * Baseline of the read and write paths: ops/s and MB/s per transfer size, printed with kunit_info.
+ * The numbers depend on the machine (UML is much slower than a real kernel), compare them on the
+ * same machine only. These cases fail only if the layer refuses an operation.
+ */
+static const size_t bench_sizes[] = { 1, 8, 64, 128, NUM_DATA_REGS };
+
+static void bench_report(struct kunit *test, const char *op, size_t size, u64 ns)
+{
+   u64 ops_per_s = div64_u64((u64)BENCH_OPS * NSEC_PER_SEC, ns ? ns : 1);
+
+   kunit_info(test, "%s %3zu bytes: %llu ops/s, %llu MB/s, %llu ns/op\n", op, size, ops_per_s,
+              div_u64(ops_per_s * size, 1000000), div_u64(ns, BENCH_OPS));
+}
+
+static void raspchar_hw_bench_read(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[NUM_DATA_REGS];
+   u64 start, ns;
+   int i, j, ret = 0;
+
+   for (i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+      start = ktime_get_ns();
+      for (j = 0; j < BENCH_OPS; j++)
+         ret |= raspchar_hw_read_data(hw, 0, bench_sizes[i], buf);
+      ns = ktime_get_ns() - start;
+      KUNIT_EXPECT_GE(test, ret, 0);
+      bench_report(test, "read ", bench_sizes[i], ns);
+   }
+}
+
+static void raspchar_hw_bench_write(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   char buf[NUM_DATA_REGS];
+   u64 start, ns;
+   int i, j, ret = 0;
+
+   memset(buf, 0x5a, sizeof(buf));
+   for (i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+      start = ktime_get_ns();
+      for (j = 0; j < BENCH_OPS; j++)
+         ret |= raspchar_hw_write_data(hw, 0, bench_sizes[i], buf);
+      ns = ktime_get_ns() - start;
+      KUNIT_EXPECT_GE(test, ret, 0);
+      bench_report(test, "write", bench_sizes[i], ns);
+   }
+}
+
+static void raspchar_hw_bench_status(struct kunit *test)
+{
+   raspchar_dev_t *hw = test->priv;
+   sts_reg_t status;
+   u64 start;
+   int j;
+
+   start = ktime_get_ns();
+   for (j = 0; j < BENCH_OPS; j++)
+      rchar_hw_get_status(hw, &status);
+   bench_report(test, "status", sizeof(status), ktime_get_ns() - start);
+   KUNIT_EXPECT_EQ(test, (int)status.device_status_reg, STS_READ_ACCESS_BIT | STS_WRITE_ACCESS_BIT);
+}
+
+static struct kunit_case raspchar_hw_bench_cases[] = {
+   KUNIT_CASE(raspchar_hw_bench_read),
+   KUNIT_CASE(raspchar_hw_bench_write),
+   KUNIT_CASE(raspchar_hw_bench_status),
+   {}
+};
+
+static struct kunit_suite raspchar_hw_bench_suite = {
+   .name = "raspchar_hw_bench",
+   .init = raspchar_hw_test_init,
+   .exit = raspchar_hw_test_exit,
+   .test_cases = raspchar_hw_bench_cases,
+};
+
+kunit_test_suites(&raspchar_hw_test_suite, &raspchar_hw_shard_test_suite, &raspchar_hw_bank_test_suite,
+                  &raspchar_hw_bench_suite);
+
+MODULE_LICENSE("GPL");
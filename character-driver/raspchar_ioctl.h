@@ -0,0 +1,44 @@
+/**
+ * @file    raspchar_ioctl.h
+ * @author  PHAM Minh Thuc
+ * @brief   Definitions shared by raspchar and the programs using /dev/raspberrychar: the ioctls and
+ * their arguments
+*/
+#ifndef RASPCHAR_IOCTL_H
+#define RASPCHAR_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include "raspchar.h"
+
+typedef struct {
+   unsigned char read_count_h_reg;
+   unsigned char read_count_l_reg;
+   unsigned char write_count_h_reg;
+   unsigned char write_count_l_reg;
+   unsigned char device_status_reg;
+} sts_reg_t;
+
+typedef struct {
+   __u64 seq;                          // number of commits, a consumer sees a new frame when it changes
+   unsigned char data_regs[NUM_DATA_REGS];
+} frame_reg_t;
+
+typedef struct {
+   __s32 fd;                           // eventfd to signal, -1 to stop the notifications
+   __u16 first_reg;                    // registers of interest: [first_reg, first_reg + num_regs)
+   __u16 num_regs;                     // 0 for all the data registers
+   __u32 min_interval_us;              // at most one signal per interval, the writes in between are coalesced
+} notify_reg_t;
+
+#define MAGICAL_NUMBER 240
+#define RCHAR_CLR_DATA_REGS _IO(MAGICAL_NUMBER, 0)
+#define RCHAR_GET_STS_REGS  _IOR(MAGICAL_NUMBER, 1, sts_reg_t *)
+#define RCHAR_RD_DATA_REGS  _IOR(MAGICAL_NUMBER, 2, unsigned char *)
+#define RCHAR_WR_DATA_REGS  _IOW(MAGICAL_NUMBER, 3, unsigned char *)
+#define RCHAR_COMMIT_DATA_REGS _IO(MAGICAL_NUMBER, 4)                 // banked mode: publish the written registers
+#define RCHAR_GET_FRAME     _IOR(MAGICAL_NUMBER, 5, frame_reg_t *)   // banked mode: copy of the published registers
+#define RCHAR_SET_NOTIFY    _IOW(MAGICAL_NUMBER, 6, notify_reg_t *)  // signal an eventfd when registers change
+#define RCHAR_GET_WRITE_SEQ _IOR(MAGICAL_NUMBER, 7, __u64 *)         // number of successful writes since load
+
+#endif
@@ -1,5 +1,5 @@
 /**
- * @file    hello.c
+ * @file    raspchar_main.c
  * @author  PHAM Minh Thuc
  * @date    7 April 2020
  * @version 0.1
@@ -22,25 +22,19 @@
 #include <linux/interrupt.h>
 #include <linux/jiffies.h>
 #include <linux/timer.h>            // Support kernel timer
+#include <linux/debugfs.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
 #include <asm/irq_vectors.h>
 #include "raspchar.h"
+#include "raspchar_hw.h"
+#include "raspchar_ioctl.h"
+#include "drvstat.h"
 
 #define IRQ_NUMBER 11
 #define DEVICE_NAME "raspberrychar"
 #define CLASS_NAME  "rasp"
-#define MAGICAL_NUMBER 240
-#define RCHAR_CLR_DATA_REGS _IO(MAGICAL_NUMBER, 0)
-#define RCHAR_GET_STS_REGS  _IOR(MAGICAL_NUMBER, 1, sts_reg_t *)
-#define RCHAR_RD_DATA_REGS  _IOR(MAGICAL_NUMBER, 2, unsigned char *)
-#define RCHAR_WR_DATA_REGS  _IOW(MAGICAL_NUMBER, 3, unsigned char *)
-
-typedef struct {
-   unsigned char read_count_h_reg;
-   unsigned char read_count_l_reg;
-   unsigned char write_count_h_reg;
-   unsigned char write_count_l_reg;
-   unsigned char device_status_reg;
-} sts_reg_t;
 
 // inode is the structure for file disk (fd). When we call open file system in user space, it return a fd.
 // struct file is the data structure used in device driver. It represents an open file. Open file
@@ -68,12 +62,12 @@ static DEFINE_MUTEX(raspchar_mutex);         // macro to define mutex
 static int ret = 0;
 //module_param(major, int, 0); ///< Param desc. charp = char ptr, S_IRUGO can be read/not changed
 //MODULE_PARM_DESC(major, "major number");  ///< parameter description
-
-typedef struct raspchar_dev {
-   unsigned char * control_regs;
-   unsigned char * status_regs;
-   unsigned char * data_regs;
-} raspchar_dev_t;
+static bool sharded = false;
+module_param(sharded, bool, 0444);
+MODULE_PARM_DESC(sharded, "one bank of data registers per CPU, merged by read (default false)");
+static bool banked = false;
+module_param(banked, bool, 0444);
+MODULE_PARM_DESC(banked, "read sees the data registers published by RCHAR_COMMIT_DATA_REGS only (default false)");
 
 struct _raspchar_drv {
    int major;
@@ -84,167 +78,196 @@ struct _raspchar_drv {
    struct timer_list raspchar_ktimer;
 } raspchar_drv;
 
+// instrumentation, in /sys/kernel/debug/raspchar/raspberrychar/
+enum {
+   RASPCHAR_STAT_READS,
+   RASPCHAR_STAT_WRITES,
+   RASPCHAR_STAT_READ_BYTES,
+   RASPCHAR_STAT_WRITE_BYTES,
+   RASPCHAR_STAT_ERRORS,            // read or write refused by the device
+   RASPCHAR_STAT_IOCTLS,
+   RASPCHAR_STAT_NOTIFIES,          // signals of the eventfd, each one for one or more writes
+   RASPCHAR_NR_STATS,
+};
+
+static const char * const raspchar_stat_names[RASPCHAR_NR_STATS] = {
+   "reads", "writes", "read_bytes", "write_bytes", "errors", "ioctls", "notifications",
+};
+
+enum {
+   RASPCHAR_HIST_READ,              // duration of read(), copy to user included
+   RASPCHAR_HIST_WRITE,
+   RASPCHAR_NR_HISTS,
+};
+
+static const char * const raspchar_hist_names[RASPCHAR_NR_HISTS] = {
+   "read_ns", "write_ns",
+};
+
+static struct drvstat raspchar_stats;
+static struct dentry *raspchar_debugfs;
+
+/*
+ * Notification of the changes by eventfd. The eventfd is signaled with the number of writes which
+ * touched the registers of interest since the previous signal, so a write storm produces at most
+ * one wakeup per min_interval. A write when the interval has elapsed signals at once, the others
+ * are signaled together by work at the end of the interval. In banked mode, the registers change
+ * for the readers at the commit, so the commits are notified instead of the writes.
+ */
+static struct raspchar_notify {
+   spinlock_t lock;                    // protects all the fields
+   struct eventfd_ctx *ctx;            // NULL when nobody is notified
+   loff_t first_reg;
+   loff_t last_reg;                    // excluded
+   unsigned long interval;             // jiffies
+   unsigned long next;                 // jiffies of the next signal allowed
+   u64 pending;                        // writes not signaled yet
+   bool scheduled;                     // work will signal the pending writes
+   struct delayed_work work;
+} raspchar_notify;
+
+// not sharded: the writes already share the main bank. Sharded: the write counters of the shards are summed
+static atomic64_t raspchar_write_seq = ATOMIC64_INIT(0);
+
 typedef struct raspchar_ktimer_data {
    int param1;
    int param2;
 } raspchar_ktimer_data_t;
 /********************************** Device specific***********************************/
-int raspchar_hw_init(raspchar_dev_t *hw)
-{
-   char * buf;
-   buf = kzalloc(NUM_DEV_REGS * REG_SIZE, GFP_KERNEL);
-   if(!buf)
-   {
-      return -ENOMEM; 
-   }
-   hw->control_regs = buf;
-   hw->status_regs = hw->control_regs + NUM_CTRL_REGS;
-   hw->data_regs = hw->status_regs + NUM_STS_REGS;
-
-   hw->control_regs[CONTROL_ACCESS_REG] = 0x03;
-   hw->status_regs[DEVICE_STATUS_REG] = 0x03;
-   return 0;
-}
-
-void raspchar_hw_exit(raspchar_dev_t *hw)
+// Function handle interrupt
+irqreturn_t raspchar_hw_isr(int irq, void *dev)
 {
-   kfree(hw->control_regs);
-}
+   /*Handle the stuff of top-half*/
+   raspchar_drv.intr_cnt++;
+   /*Handle the stuff of bottom-half*/
 
-/* Read data from rasp char device - harware virtual. If we read data from a real device, instead of using memcpy, using function to read data from device (ex: I2C_READ...*/
-int raspchar_hw_read_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf)
-{
-   int read_bytes = num_regs;
-
-   // Verify weather we can read data from data registers
-   if ((hw->control_regs[CONTROL_ACCESS_REG] & CTRL_READ_DATA_BIT) == DISABLE)
-      return -1;
-   // Verify address of kernel buffer   
-   if(kbuf == NULL)
-      return -1;
-   // Verify position the registers
-   if(start_reg > NUM_DATA_REGS)
-      return -1;
-   // Handle the number of registers read
-   if(num_regs > (NUM_DATA_REGS - start_reg))
-      read_bytes = NUM_DATA_REGS - start_reg;
-   // Write data from device to kernel buffer
-   memcpy(kbuf, hw->data_regs + start_reg, read_bytes);
-   // Update the number reading
-   hw->status_regs[READ_COUNT_L_REG] += 1;
-   if(hw->status_regs[READ_COUNT_L_REG] == 0)
-      hw->status_regs[READ_COUNT_H_REG] += 1;
-   return read_bytes;
+   return IRQ_HANDLED;
 }
 
-int raspchar_hw_write_data(raspchar_dev_t *hw, loff_t start_reg, size_t num_regs, char* kbuf)
+/********************************** OS specific ***********************************/
+// with raspchar_notify.lock held
+static void raspchar_notify_signal(void)
 {
-   int write_bytes = num_regs;
-   // Verify weather we can write to data register
-   if ((hw->control_regs[CONTROL_ACCESS_REG] & CTRL_WRITE_DATA_BIT) == DISABLE)
-      return -1;
-   // Verify address of kernel buffer
-   if (kbuf == NULL)
-      return -1;
-   // Verify position of register to write on data register
-   if (start_reg > NUM_DATA_REGS)
-      return -1;
-   // Handle number of registers can be written to data register
-   if (num_regs > NUM_DATA_REGS - start_reg)
-   {
-      write_bytes = NUM_DATA_REGS - start_reg;
-      hw->status_regs[DEVICE_STATUS_REG] |= STS_DATAREGS_OVERFLOW_BIT;
-   }
-   // Update data from data register to kernel buffer
-   memcpy(hw->data_regs + start_reg,kbuf, write_bytes);
-   //printk("data in data register %s\n",hw->data_regs + start_reg);
-   // Update number writing
-   hw->status_regs[WRITE_COUNT_L_REG] += 1;
-   if(hw->status_regs[WRITE_COUNT_L_REG] == 0)
-      hw->status_regs[WRITE_COUNT_H_REG] += 1;
-   return write_bytes; 
+   eventfd_signal(raspchar_notify.ctx, raspchar_notify.pending);
+   raspchar_notify.pending = 0;
+   raspchar_notify.next = jiffies + raspchar_notify.interval;
+   drvstat_inc(&raspchar_stats, RASPCHAR_STAT_NOTIFIES);
 }
 
-int rchar_hw_clear(raspchar_dev_t *hw)
+static void raspchar_notify_work(struct work_struct *work)
 {
-   if((hw->control_regs[CONTROL_ACCESS_REG] & CTRL_WRITE_DATA_BIT) == DISABLE)
-      return -1;
-   memset(hw->data_regs, 0, NUM_DATA_REGS * REG_SIZE);
-   hw->status_regs[DEVICE_STATUS_REG] &= ~STS_DATAREGS_OVERFLOW_BIT;
-   return 0;
+   spin_lock(&raspchar_notify.lock);
+   raspchar_notify.scheduled = false;
+   if (raspchar_notify.ctx && raspchar_notify.pending)
+      raspchar_notify_signal();
+   spin_unlock(&raspchar_notify.lock);
 }
 
-void rchar_hw_get_status(raspchar_dev_t *hw, sts_reg_t *status)
+/* A write changed the registers [start_reg, start_reg + num_regs) */
+static void raspchar_notify_write(loff_t start_reg, int num_regs)
 {
-   memcpy(status, hw->status_regs, NUM_STS_REGS * REG_SIZE);
-}
+   unsigned long now = jiffies;
 
-void vchar_hw_enable_read(raspchar_dev_t *hw, unsigned char isEnable)
-{
-   if(isEnable == ENABLE)
-   {
-      // Enable bit inform that data is ready read
-      hw->status_regs[DEVICE_STATUS_REG] |= STS_READ_ACCESS_BIT;
-      // Enable bit give the permit reading
-      hw->control_regs[CONTROL_ACCESS_REG] |= CTRL_READ_DATA_BIT;
+   // nobody notified: the writers stay off the shared lock, checked again under it
+   if (!READ_ONCE(raspchar_notify.ctx))
+      return;
+   spin_lock(&raspchar_notify.lock);
+   if (!raspchar_notify.ctx || num_regs <= 0 ||
+       start_reg >= raspchar_notify.last_reg || start_reg + num_regs <= raspchar_notify.first_reg) {
+      spin_unlock(&raspchar_notify.lock);
+      return;
    }
-   else
-   {
-      // Disable bit inform that data is ready read
-      hw->status_regs[DEVICE_STATUS_REG] &= ~STS_READ_ACCESS_BIT;
-      // Disable bit give the permit reading
-      hw->control_regs[CONTROL_ACCESS_REG] &= ~CTRL_READ_DATA_BIT;
+   raspchar_notify.pending++;
+   if (!raspchar_notify.scheduled) {
+      if (time_after_eq(now, raspchar_notify.next)) {
+         raspchar_notify_signal();
+      } else {
+         raspchar_notify.scheduled = true;
+         schedule_delayed_work(&raspchar_notify.work, raspchar_notify.next - now);
+      }
    }
+   spin_unlock(&raspchar_notify.lock);
 }
 
-void vchar_hw_enable_write(raspchar_dev_t *hw, unsigned char isEnable)
+/* Replace the eventfd notified, NULL ctx stops the notifications */
+static void raspchar_notify_set(struct eventfd_ctx *ctx, loff_t first_reg, loff_t last_reg, unsigned long interval)
 {
-   if(isEnable == ENABLE)
-   {
-      // Enable bit inform that data is ready written
-      hw->status_regs[DEVICE_STATUS_REG] |= STS_WRITE_ACCESS_BIT;
-      // Enable bit give the permit write
-      hw->control_regs[CONTROL_ACCESS_REG] |= CTRL_WRITE_DATA_BIT;
-   }
-   else
-   {
-      // Disable bit inform that data is ready written
-      hw->status_regs[DEVICE_STATUS_REG] &= ~STS_WRITE_ACCESS_BIT;
-      // Disable bit give the permit writing
-      hw->control_regs[CONTROL_ACCESS_REG] &= ~CTRL_WRITE_DATA_BIT;
+   struct eventfd_ctx *old;
+
+   spin_lock(&raspchar_notify.lock);
+   old = raspchar_notify.ctx;
+   WRITE_ONCE(raspchar_notify.ctx, ctx);
+   raspchar_notify.first_reg = first_reg;
+   raspchar_notify.last_reg = last_reg;
+   raspchar_notify.interval = interval;
+   raspchar_notify.next = jiffies;
+   raspchar_notify.pending = 0;
+   spin_unlock(&raspchar_notify.lock);
+
+   // a signal scheduled for the previous eventfd is dropped, the writes since the swap are kept
+   cancel_delayed_work_sync(&raspchar_notify.work);
+   spin_lock(&raspchar_notify.lock);
+   raspchar_notify.scheduled = false;
+   if (raspchar_notify.ctx && raspchar_notify.pending) {
+      raspchar_notify.scheduled = true;
+      schedule_delayed_work(&raspchar_notify.work, 0);
    }
+   spin_unlock(&raspchar_notify.lock);
+   if (old)
+      eventfd_ctx_put(old);
 }
 
-// Function handle interrupt
-irqreturn_t raspchar_hw_isr(int irq, void *dev)
+static long raspchar_notify_ioctl(notify_reg_t __user *arg)
 {
-   /*Handle the stuff of top-half*/
-   raspchar_drv.intr_cnt++;
-   /*Handle the stuff of bottom-half*/
+   notify_reg_t req;
+   struct eventfd_ctx *ctx;
+   unsigned int num_regs;
 
-   return IRQ_HANDLED;
+   if (copy_from_user(&req, arg, sizeof(req)))
+      return -EFAULT;
+   if (req.fd < 0) {
+      raspchar_notify_set(NULL, 0, 0, 0);
+      return 0;
+   }
+   num_regs = req.num_regs ? req.num_regs : NUM_DATA_REGS;
+   if (req.first_reg >= NUM_DATA_REGS || num_regs > NUM_DATA_REGS - req.first_reg)
+      return -EINVAL;
+   ctx = eventfd_ctx_fdget(req.fd);
+   if (IS_ERR(ctx))
+      return PTR_ERR(ctx);
+   raspchar_notify_set(ctx, req.first_reg, req.first_reg + num_regs, usecs_to_jiffies(req.min_interval_us));
+   return 0;
 }
 
-/********************************** OS specific ***********************************/
 static ssize_t read_function(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
    char *kernel_buf = NULL;
    int num_bytes = 0;
+   u64 start = drvstat_now();
 
-   printk(KERN_INFO "Handle read event from %lld, %zu bytes", *ppos, count);
    kernel_buf = kzalloc(count, GFP_KERNEL);
    if(kernel_buf == NULL)
    {
       return 0;
    }
    
-   num_bytes = raspchar_hw_read_data(raspchar_drv.raspchar_hw,*ppos,count,kernel_buf);
-   if(num_bytes < 0)
+   if (sharded)
+      num_bytes = raspchar_hw_shard_read_data(raspchar_drv.raspchar_hw,*ppos,count,kernel_buf);
+   else if (banked)
+      num_bytes = raspchar_hw_bank_read_data(raspchar_drv.raspchar_hw,*ppos,count,kernel_buf);
+   else
+      num_bytes = raspchar_hw_read_data(raspchar_drv.raspchar_hw,*ppos,count,kernel_buf);
+   if(num_bytes < 0 || copy_to_user(buf,kernel_buf,num_bytes))
+   {
+      kfree(kernel_buf);
+      drvstat_inc(&raspchar_stats, RASPCHAR_STAT_ERRORS);
       return -EFAULT;
-   if (copy_to_user(buf,kernel_buf,num_bytes))
-      return -EFAULT;  
-   printk(KERN_INFO "RaspChar: sent %d characters to the user\n",num_bytes);
+   }
+   kfree(kernel_buf);
    *ppos += num_bytes; 
+   drvstat_inc(&raspchar_stats, RASPCHAR_STAT_READS);
+   drvstat_add(&raspchar_stats, RASPCHAR_STAT_READ_BYTES, num_bytes);
+   drvstat_hist_since(&raspchar_stats, RASPCHAR_HIST_READ, start);
    return num_bytes;
 }
 
@@ -252,16 +275,37 @@ static ssize_t write_function(struct file *file, const char __user *buf, size_t
 {
    char* kernel_buf = NULL;
    int num_bytes = 0;
-   printk(KERN_INFO "raspbChar: Recieved %zu letters from the user\n",count);
+   u64 start = drvstat_now();
 
    kernel_buf = kzalloc(count,GFP_KERNEL);
+   if(kernel_buf == NULL)
+      return -ENOMEM;
    if(copy_from_user(kernel_buf,buf,count))
+   {
+      kfree(kernel_buf);
+      drvstat_inc(&raspchar_stats, RASPCHAR_STAT_ERRORS);
       return -EFAULT;
-   num_bytes = raspchar_hw_write_data(raspchar_drv.raspchar_hw,*ppos,count,kernel_buf);
-   printk(KERN_INFO "Write %d bytes to hw", num_bytes);
+   }
+   if (sharded)
+      num_bytes = raspchar_hw_shard_write_data(raspchar_drv.raspchar_hw,*ppos,count,kernel_buf);
+   else if (banked)
+      num_bytes = raspchar_hw_bank_write_data(raspchar_drv.raspchar_hw,*ppos,count,kernel_buf);
+   else
+      num_bytes = raspchar_hw_write_data(raspchar_drv.raspchar_hw,*ppos,count,kernel_buf);
+   kfree(kernel_buf);
    if(num_bytes < 0)
+   {
+      drvstat_inc(&raspchar_stats, RASPCHAR_STAT_ERRORS);
       return -EFAULT;
+   }
+   if (!sharded)
+      atomic64_inc(&raspchar_write_seq);
+   if (!banked)
+      raspchar_notify_write(*ppos, num_bytes);
    *ppos += num_bytes;
+   drvstat_inc(&raspchar_stats, RASPCHAR_STAT_WRITES);
+   drvstat_add(&raspchar_stats, RASPCHAR_STAT_WRITE_BYTES, num_bytes);
+   drvstat_hist_since(&raspchar_stats, RASPCHAR_HIST_WRITE, start);
    return num_bytes;
 }
 
@@ -271,17 +315,27 @@ static long ioctl_function(struct file *file, unsigned int cmd, unsigned long ar
    unsigned char isWriteEnable;
    sts_reg_t status;
    ret = 0;
-   printk(KERN_INFO "Handle event ioctl (cmd: %u)\n", cmd);
+   drvstat_inc(&raspchar_stats, RASPCHAR_STAT_IOCTLS);
    switch(cmd) {
       case RCHAR_CLR_DATA_REGS:
-         ret = rchar_hw_clear(raspchar_drv.raspchar_hw);
+         if (sharded)
+            ret = raspchar_hw_shard_clear(raspchar_drv.raspchar_hw);
+         else if (banked)
+            ret = raspchar_hw_bank_clear(raspchar_drv.raspchar_hw);
+         else
+            ret = rchar_hw_clear(raspchar_drv.raspchar_hw);
          if (ret < 0)
             printk(KERN_INFO "Raspchar: Can not clear data on data registers");
          else
             printk(KERN_INFO "Raspchar: Data registers are cleared");
          break;
       case RCHAR_GET_STS_REGS:
-         rchar_hw_get_status(raspchar_drv.raspchar_hw,&status);
+         if (sharded)
+            raspchar_hw_shard_get_status(raspchar_drv.raspchar_hw,&status);
+         else if (banked)
+            raspchar_hw_bank_get_status(raspchar_drv.raspchar_hw,&status);
+         else
+            rchar_hw_get_status(raspchar_drv.raspchar_hw,&status);
          (void)copy_to_user((sts_reg_t*)arg, &status, sizeof(status));
          printk(KERN_INFO "Raspchar: Got information status register");
          break;
@@ -295,6 +349,34 @@ static long ioctl_function(struct file *file, unsigned int cmd, unsigned long ar
          vchar_hw_enable_write(raspchar_drv.raspchar_hw,isWriteEnable);
          printk(KERN_INFO "Raspchar: changed permit of writing");
          break;
+      case RCHAR_COMMIT_DATA_REGS:
+         if (!banked)
+            return -ENOTTY;
+         ret = raspchar_hw_bank_commit(raspchar_drv.raspchar_hw);
+         if (ret == 0)
+            raspchar_notify_write(0, NUM_DATA_REGS);
+         break;
+      case RCHAR_GET_FRAME:
+      {
+         frame_reg_t frame;
+
+         if (!banked)
+            return -ENOTTY;
+         frame.seq = raspchar_hw_bank_snapshot(raspchar_drv.raspchar_hw, frame.data_regs);
+         if (copy_to_user((frame_reg_t *)arg, &frame, sizeof(frame)))
+            return -EFAULT;
+         break;
+      }
+      case RCHAR_SET_NOTIFY:
+         return raspchar_notify_ioctl((notify_reg_t __user *)arg);
+      case RCHAR_GET_WRITE_SEQ:
+      {
+         u64 seq = sharded ? raspchar_hw_shard_write_seq(raspchar_drv.raspchar_hw) : atomic64_read(&raspchar_write_seq);
+
+         if (copy_to_user((__u64 __user *)arg, &seq, sizeof(seq)))
+            return -EFAULT;
+         break;
+      }
       default:
          break;
    }
@@ -411,6 +493,8 @@ static int  open_function(struct inode *inode, struct file *file)
 
 static int  release_function(struct inode *inode, struct file *file)
 {
+   // the notifications belong to the file which asked them
+   raspchar_notify_set(NULL, 0, 0, 0);
    mutex_unlock(&raspchar_mutex);
    printk(KERN_INFO "RaspChar: device has been closed\n");
    return 0;
@@ -461,9 +545,19 @@ static void configure_timer(struct timer_list *ktimer)
 static int __init kernel_module_init(void)
 {
    printk(KERN_INFO "Initializing the RaspberryChar LKM\n");
+   if (sharded && banked) {
+      printk(KERN_ERR "RaspChar: sharded and banked can not be used together\n");
+      return -EINVAL;
+   }
+   spin_lock_init(&raspchar_notify.lock);
+   INIT_DELAYED_WORK(&raspchar_notify.work, raspchar_notify_work);
+   ret = drvstat_init(&raspchar_stats, raspchar_stat_names, RASPCHAR_NR_STATS, raspchar_hist_names, RASPCHAR_NR_HISTS);
+   if (ret < 0)
+      return ret;
    // try to dynamically allocate a mojor number
    raspchar_drv.major = register_chrdev(raspchar_drv.major,DEVICE_NAME, &fops);
    if (raspchar_drv.major < 0) {
+      drvstat_exit(&raspchar_stats);
       printk(KERN_WARNING "Problem with major\n");
       return raspchar_drv.major;
    }
@@ -471,6 +565,7 @@ static int __init kernel_module_init(void)
    raspchar_drv.raspcharClass = class_create(THIS_MODULE, CLASS_NAME);
    if (IS_ERR(raspchar_drv.raspcharClass)) {
       unregister_chrdev(raspchar_drv.major,DEVICE_NAME);
+      drvstat_exit(&raspchar_stats);
       printk(KERN_ALERT "Failed to register device class\n");
       return PTR_ERR(raspchar_drv.raspcharClass);
    }
@@ -480,6 +575,7 @@ static int __init kernel_module_init(void)
    if (IS_ERR(raspchar_drv.raspcharDevice)) {
       class_destroy(raspchar_drv.raspcharClass);
       unregister_chrdev(raspchar_drv.major,DEVICE_NAME);
+      drvstat_exit(&raspchar_stats);
       printk(KERN_ALERT "Failed to create a device\n");
       return PTR_ERR(raspchar_drv.raspcharDevice);
    }
@@ -491,16 +587,24 @@ static int __init kernel_module_init(void)
       device_destroy(raspchar_drv.raspcharClass, MKDEV(raspchar_drv.major,0));
       class_destroy(raspchar_drv.raspcharClass);
       unregister_chrdev(raspchar_drv.major,DEVICE_NAME);
+      drvstat_exit(&raspchar_stats);
       printk(KERN_ERR "failed to allocate data structure of the driver");
       return -ENOMEM;
    }
    ret = raspchar_hw_init(raspchar_drv.raspchar_hw);
+   if(ret == 0 && (sharded || banked))
+   {
+      ret = sharded ? raspchar_hw_shard_init(raspchar_drv.raspchar_hw) : raspchar_hw_bank_init(raspchar_drv.raspchar_hw);
+      if(ret < 0)
+         raspchar_hw_exit(raspchar_drv.raspchar_hw);
+   }
    if(ret < 0)
    {
       kfree(raspchar_drv.raspchar_hw);
       device_destroy(raspchar_drv.raspcharClass, MKDEV(raspchar_drv.major,0));
       class_destroy(raspchar_drv.raspcharClass);
       unregister_chrdev(raspchar_drv.major,DEVICE_NAME);
+      drvstat_exit(&raspchar_stats);
       return ret;
    }
    ret = request_irq(IRQ_NUMBER, raspchar_hw_isr,IRQF_SHARED,"raspchar_dev",&raspchar_drv.raspcharDevice);
@@ -511,6 +615,7 @@ static int __init kernel_module_init(void)
       device_destroy(raspchar_drv.raspcharClass, MKDEV(raspchar_drv.major,0));
       class_destroy(raspchar_drv.raspcharClass);
       unregister_chrdev(raspchar_drv.major,DEVICE_NAME);
+      drvstat_exit(&raspchar_stats);
       printk(KERN_ERR "Failed to register IRQ\n");
       return ret;
    }
@@ -526,6 +631,10 @@ static int __init kernel_module_init(void)
       unregister_chrdev(raspchar_drv.major,DEVICE_NAME);
    }
 
+   raspchar_debugfs = debugfs_create_dir("raspchar", NULL);
+   drvstat_init_root(raspchar_debugfs);
+   drvstat_export(&raspchar_stats, raspchar_debugfs, DEVICE_NAME);
+
    timer_setup(&raspchar_drv.raspchar_ktimer,handle_timer,TIMER_IRQSAFE);
    configure_timer(&raspchar_drv.raspchar_ktimer);
    add_timer(&raspchar_drv.raspchar_ktimer);
@@ -537,6 +646,7 @@ static int __init kernel_module_init(void)
 static void __exit kernel_module_cleanup(void)
 {
    printk(KERN_INFO "Raspchar: Exit raspchar driver");
+   raspchar_notify_set(NULL, 0, 0, 0);
    del_timer(&raspchar_drv.raspchar_ktimer);
    remove_proc_entry("raspchar_proc",NULL);
    free_irq(IRQ_NUMBER,&raspchar_drv.raspcharDevice);
@@ -546,6 +656,8 @@ static void __exit kernel_module_cleanup(void)
    //class_unregister(raspchar_drv.raspcharClass);               //unregister the device class
    class_destroy(raspchar_drv.raspcharClass);                  //remove the device class
    unregister_chrdev(raspchar_drv.major,DEVICE_NAME);
+   drvstat_exit(&raspchar_stats);                              // no read or write after unregister_chrdev
+   debugfs_remove_recursive(raspchar_debugfs);
    mutex_destroy(&raspchar_mutex);
 }
 
@@ -0,0 +1,180 @@
+/**
+ * @file    testnotify.c
+ * @author  PHAM Minh Thuc
+ * @brief   Checks the eventfd notification of raspchar (RCHAR_SET_NOTIFY) against the loaded module:
+ *    - range: a write outside the registers of interest is not signaled, a write inside is
+ *    - pending: the writes closer than the interval are signaled once, with their number as value
+ *    - interval: a write storm wakes the consumer at most once per interval, and the values read
+ *      add up to the writes counted by RCHAR_GET_WRITE_SEQ
+ *    - stop: fd -1 stops the notifications
+ * The module must be loaded without banked=1 (banked mode notifies the commits, not the writes):
+ *    ./testnotify [-i interval_ms] [-t storm_seconds]
+*/
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<time.h>
+#include<poll.h>
+#include<pthread.h>
+#include<sys/ioctl.h>
+#include<sys/eventfd.h>
+#include "raspchar_ioctl.h"
+
+#define NODE_DEVICE  "/dev/raspberrychar"
+#define SLACK_MS 20                     // scheduling of the work signaling the pending writes
+
+static int fd, efd, interval_ms = 100, failures;
+static volatile int storming;
+
+static uint64_t now_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void check(int ok, const char *what) {
+   printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+   if (!ok)
+      failures++;
+}
+
+static int set_notify(int eventfd, int first_reg, int num_regs) {
+   notify_reg_t req = { .fd = eventfd, .first_reg = first_reg, .num_regs = num_regs,
+                        .min_interval_us = interval_ms * 1000 };
+   return ioctl(fd, RCHAR_SET_NOTIFY, &req);
+}
+
+static uint64_t write_seq() {
+   __u64 seq = 0;
+   if (ioctl(fd, RCHAR_GET_WRITE_SEQ, &seq) < 0)
+      perror("RCHAR_GET_WRITE_SEQ");
+   return seq;
+}
+
+// value of the eventfd after at most timeout_ms, 0 if it was not signaled
+static uint64_t wait_event(int timeout_ms) {
+   struct pollfd pfd = { .fd = efd, .events = POLLIN };
+   uint64_t value = 0;
+
+   if (poll(&pfd, 1, timeout_ms) == 1 && read(efd, &value, sizeof(value)) != sizeof(value))
+      value = 0;
+   return value;
+}
+
+static void write_reg(int reg) {
+   char c = (char)reg;
+   if (pwrite(fd, &c, 1, reg) != 1)
+      perror("Failed to write to the device");
+}
+
+static void test_range() {
+   // a new registration signals its first write at once, without waiting for the interval
+   set_notify(efd, 16, 16);
+   write_reg(100);
+   write_reg(15);
+   check(wait_event(interval_ms + SLACK_MS) == 0, "writes outside [16, 32) are not signaled");
+   write_reg(20);
+   check(wait_event(interval_ms + SLACK_MS) == 1, "a write inside [16, 32) is signaled");
+}
+
+static void test_pending() {
+   int i;
+   uint64_t value;
+
+   set_notify(efd, 0, 0);
+   write_reg(0);
+   check(wait_event(SLACK_MS) == 1, "the first write is signaled at once");
+   for (i = 0; i < 10; i++)
+      write_reg(i);
+   check(wait_event(interval_ms / 2) == 0, "writes within the interval are not signaled at once");
+   value = wait_event(interval_ms + SLACK_MS);
+   printf("      eventfd value %llu for 10 writes\n", (unsigned long long)value);
+   check(value == 10, "the writes within the interval are signaled once, with their number");
+}
+
+static void *storm_run(void *arg) {
+   while (storming)
+      write_reg(rand() % NUM_DATA_REGS);
+   return NULL;
+}
+
+static void test_interval(int seconds) {
+   pthread_t thread;
+   uint64_t start, end, seq_start, sum = 0, value, wakeups = 0, bound;
+
+   set_notify(efd, 0, 0);
+   usleep(interval_ms * 1000 + SLACK_MS * 1000);
+   seq_start = write_seq();
+   storming = 1;
+   pthread_create(&thread, NULL, storm_run, NULL);
+   start = now_ms();
+   end = start + seconds * 1000;
+   while (now_ms() < end) {
+      value = wait_event(end - now_ms());
+      if (value) {
+         sum += value;
+         wakeups++;
+      }
+   }
+   storming = 0;
+   pthread_join(thread, NULL);
+   // the writes still pending are signaled at the end of their interval
+   while ((value = wait_event(interval_ms + SLACK_MS)))
+      sum += value;
+
+   bound = (now_ms() - start) / interval_ms + 2;
+   printf("      %llu wakeups in %d s (bound %llu), %llu writes signaled, %llu written\n",
+          (unsigned long long)wakeups, seconds, (unsigned long long)bound, (unsigned long long)sum,
+          (unsigned long long)(write_seq() - seq_start));
+   check(wakeups <= bound, "a write storm wakes the consumer at most once per interval");
+   check(sum == write_seq() - seq_start, "the eventfd values add up to the write sequence");
+}
+
+static void test_stop() {
+   set_notify(-1, 0, 0);
+   write_reg(0);
+   check(wait_event(interval_ms + SLACK_MS) == 0, "no signal after fd -1");
+}
+
+int main(int argc, char *argv[]) {
+   int seconds = 2;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "i:t:")) != -1) {
+      switch (opt) {
+         case 'i': interval_ms = atoi(optarg); break;
+         case 't': seconds = atoi(optarg); break;
+         default:
+            fprintf(stderr, "usage: %s [-i interval_ms] [-t storm_seconds]\n", argv[0]);
+            return 1;
+      }
+   }
+   if (interval_ms < 10 || seconds < 1) {
+      fprintf(stderr, "interval must be at least 10 ms, storm at least 1 s\n");
+      return 1;
+   }
+   fd = open(NODE_DEVICE, O_RDWR);
+   if (fd < 0) {
+      perror("Failed to open the device...");
+      return errno;
+   }
+   efd = eventfd(0, EFD_NONBLOCK);
+   if (efd < 0) {
+      perror("Failed to create the eventfd");
+      return errno;
+   }
+
+   test_range();
+   test_pending();
+   test_interval(seconds);
+   test_stop();
+
+   close(efd);
+   close(fd);
+   printf("%s\n", failures ? "FAILED" : "OK");
+   return failures ? 1 : 0;
+}
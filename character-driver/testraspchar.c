@@ -12,20 +12,8 @@
 #include<string.h>
 #include<unistd.h>
 #include<sys/ioctl.h>
+#include "raspchar_ioctl.h"
 
-typedef struct {                                                                                                        
-  unsigned char read_count_h;                                                                                           
-  unsigned char read_count_l;                                                                                           
-  unsigned char write_count_h;                                                                                          
-  unsigned char write_count_l;                                                                                          
-  unsigned char device_status;                                                                                          
-} status_t; 
-
-#define MAGICAL_NUMBER 240
-#define RCHAR_CLR_DATA_REGS _IO(MAGICAL_NUMBER, 0)
-#define RCHAR_GET_STS_REGS  _IOR(MAGICAL_NUMBER, 1, status_t *)
-#define RCHAR_RD_DATA_REGS  _IOR(MAGICAL_NUMBER, 2, unsigned char *)
-#define RCHAR_WR_DATA_REGS  _IOW(MAGICAL_NUMBER, 3, unsigned char *)
 #define BUFFER_LENGTH 256               ///< The buffer length (crude but fine)
 #define NODE_DEVICE  "/dev/raspberrychar"
 
@@ -53,19 +41,19 @@ void clear_data_raspdev() {
 }
 
 void get_status_raspdev() {
-   status_t status;
+   sts_reg_t status;
    unsigned int read_cnt, write_cnt;   
    int fd = open_raspdev();
-   ioctl(fd, RCHAR_GET_STS_REGS, (status_t *)&status);
+   ioctl(fd, RCHAR_GET_STS_REGS, (sts_reg_t *)&status);
    close(fd);
-   read_cnt = status.read_count_h << 8 | status.read_count_l;
-   write_cnt = status.write_count_h << 8 | status.write_count_l;
+   read_cnt = status.read_count_h_reg << 8 | status.read_count_l_reg;
+   write_cnt = status.write_count_h_reg << 8 | status.write_count_l_reg;
    printf("Static: number of reading (%u) times, number of writing (%u) times\n", read_cnt, write_cnt); 
 }
 
 void control_read_raspchar() {
    unsigned char isReadable;
-   status_t status;
+   sts_reg_t status;
    char c = 'n';
    printf("Do you want to enable reading on data registers? (y/n)");
    scanf("%[^\n]%*c",&c);
@@ -76,9 +64,9 @@ void control_read_raspchar() {
    else return;
    int fd = open_raspdev();
    ioctl(fd, RCHAR_RD_DATA_REGS, (unsigned char *)&isReadable);
-   ioctl(fd, RCHAR_GET_STS_REGS, (status_t *)&status);
+   ioctl(fd, RCHAR_GET_STS_REGS, (sts_reg_t *)&status);
    close(fd);
-   if (status.device_status & 0x01)
+   if (status.device_status_reg & 0x01)
       printf("Enabled to read data from data registers\n");
    else
       printf("Disable to read data from data registers\n");    
@@ -86,7 +74,7 @@ void control_read_raspchar() {
 
 void control_write_raspchar() {                                                                                          
    unsigned char isWritable;                                                                                            
-   status_t status;                                                                                                     
+   sts_reg_t status;                                                                                                     
    char c = 'n';                                                                                                        
    printf("Do you want to enable writing on data registers? (y/n)");                                                   
    scanf("%[^\n]%*c",&c);                                                                                                      
@@ -97,9 +85,9 @@ void control_write_raspchar() {
    else return;                                                                                                         
    int fd = open_raspdev();                                                                                             
    ioctl(fd, RCHAR_WR_DATA_REGS, (unsigned char *)&isWritable);                                                          
-   ioctl(fd, RCHAR_GET_STS_REGS, (status_t *)&status);                                                                  
+   ioctl(fd, RCHAR_GET_STS_REGS, (sts_reg_t *)&status);                                                                  
    close(fd);                                                                                                           
-   if (status.device_status & 0x02)                                                                                      
+   if (status.device_status_reg & 0x02)                                                                                      
       printf("Enabled to write data from data registers\n");                                                               
    else                                                                                                                 
       printf("Disable to write data from data registers\n");                                                               
@@ -0,0 +1,190 @@
+/**
+ * @file    drvstat.h
+ * @author  PHAM Minh Thuc
+ * @brief   Instrumentation shared by the drivers: per-CPU counters and log2 latency histograms, exported
+ * in debugfs with the same layout for every driver, so one scrape works for all the devices:
+ *    /sys/kernel/debug/<driver>/stats_enable              1 or 0, switches the instrumentation at runtime
+ *    /sys/kernel/debug/<driver>/<instance>/counters       "name: value", one counter per line
+ *    /sys/kernel/debug/<driver>/<instance>/histograms     "name:" then "  [lo, hi) ns: count" per bucket used
+ * A disabled instrumentation costs one static branch (a nop) per call. Built with -DDRVSTAT_DISABLE,
+ * every helper is empty and nothing is created in debugfs.
+ * The state is static: a module includes this header in one file only.
+*/
+#ifndef DRVSTAT_H
+#define DRVSTAT_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+
+#define DRVSTAT_HIST_BUCKETS 32     // bucket i counts the durations in [2^i, 2^(i+1)) ns
+
+struct drvstat {
+   const char * const *counter_names;
+   unsigned int nr_counters;
+   const char * const *hist_names;
+   unsigned int nr_hists;
+   u64 __percpu *data;              // nr_counters counters, then DRVSTAT_HIST_BUCKETS buckets per histogram
+   struct dentry *dir;
+};
+
+#ifndef DRVSTAT_DISABLE
+
+static DEFINE_STATIC_KEY_TRUE(drvstat_key);
+
+static inline bool drvstat_enabled(void)
+{
+   return static_branch_likely(&drvstat_key);
+}
+
+static inline void drvstat_add(struct drvstat *st, unsigned int counter, u64 value)
+{
+   if (drvstat_enabled())
+      this_cpu_add(st->data[counter], value);
+}
+
+static inline void drvstat_inc(struct drvstat *st, unsigned int counter)
+{
+   drvstat_add(st, counter, 1);
+}
+
+static inline void drvstat_hist_add(struct drvstat *st, unsigned int hist, u64 ns)
+{
+   unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), DRVSTAT_HIST_BUCKETS - 1) : 0;
+
+   if (drvstat_enabled())
+      this_cpu_inc(st->data[st->nr_counters + hist * DRVSTAT_HIST_BUCKETS + bucket]);
+}
+
+/* Start of a measured duration, 0 when the instrumentation is disabled */
+static inline u64 drvstat_now(void)
+{
+   return drvstat_enabled() ? ktime_get_ns() : 0;
+}
+
+/* Record the duration since start, taken with drvstat_now() */
+static inline void drvstat_hist_since(struct drvstat *st, unsigned int hist, u64 start)
+{
+   if (drvstat_enabled() && start)
+      drvstat_hist_add(st, hist, ktime_get_ns() - start);
+}
+
+static inline u64 drvstat_sum(struct drvstat *st, unsigned int index)
+{
+   u64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      sum += *per_cpu_ptr(&st->data[index], cpu);
+   return sum;
+}
+
+static int drvstat_counters_show(struct seq_file *s, void *unused)
+{
+   struct drvstat *st = s->private;
+   unsigned int i;
+
+   for (i = 0; i < st->nr_counters; i++)
+      seq_printf(s, "%s: %llu\n", st->counter_names[i], drvstat_sum(st, i));
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(drvstat_counters);
+
+static int drvstat_histograms_show(struct seq_file *s, void *unused)
+{
+   struct drvstat *st = s->private;
+   unsigned int i, bucket;
+   u64 count;
+
+   for (i = 0; i < st->nr_hists; i++) {
+      seq_printf(s, "%s:\n", st->hist_names[i]);
+      for (bucket = 0; bucket < DRVSTAT_HIST_BUCKETS; bucket++) {
+         count = drvstat_sum(st, st->nr_counters + i * DRVSTAT_HIST_BUCKETS + bucket);
+         if (count)
+            seq_printf(s, "  [%llu, %llu) ns: %llu\n", 1ULL << bucket, 1ULL << (bucket + 1), count);
+      }
+   }
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(drvstat_histograms);
+
+static int drvstat_enable_get(void *data, u64 *val)
+{
+   *val = static_key_enabled(&drvstat_key);
+   return 0;
+}
+
+static int drvstat_enable_set(void *data, u64 val)
+{
+   if (val)
+      static_branch_enable(&drvstat_key);
+   else
+      static_branch_disable(&drvstat_key);
+   return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(drvstat_enable_fops, drvstat_enable_get, drvstat_enable_set, "%llu\n");
+
+/* Create the switch of the driver in its debugfs directory */
+static inline void drvstat_init_root(struct dentry *root)
+{
+   debugfs_create_file_unsafe("stats_enable", 0644, root, NULL, &drvstat_enable_fops);
+}
+
+/* Allocate the counters and histograms of one instance, they are counted from now on */
+static inline int drvstat_init(struct drvstat *st, const char * const *counter_names, unsigned int nr_counters,
+                               const char * const *hist_names, unsigned int nr_hists)
+{
+   st->counter_names = counter_names;
+   st->nr_counters = nr_counters;
+   st->hist_names = hist_names;
+   st->nr_hists = nr_hists;
+   st->dir = NULL;
+   st->data = __alloc_percpu((nr_counters + nr_hists * DRVSTAT_HIST_BUCKETS) * sizeof(u64), sizeof(u64));
+   return st->data ? 0 : -ENOMEM;
+}
+
+/* Export the instance in parent/name, when its name is known */
+static inline void drvstat_export(struct drvstat *st, struct dentry *parent, const char *name)
+{
+   st->dir = debugfs_create_dir(name, parent);
+   debugfs_create_file("counters", 0444, st->dir, st, &drvstat_counters_fops);
+   debugfs_create_file("histograms", 0444, st->dir, st, &drvstat_histograms_fops);
+}
+
+static inline void drvstat_unexport(struct drvstat *st)
+{
+   debugfs_remove_recursive(st->dir);
+   st->dir = NULL;
+}
+
+/* The files are removed first: a reader of the files never sees freed counters */
+static inline void drvstat_exit(struct drvstat *st)
+{
+   drvstat_unexport(st);
+   free_percpu(st->data);
+   st->data = NULL;
+}
+
+#else /* DRVSTAT_DISABLE */
+
+static inline bool drvstat_enabled(void) { return false; }
+static inline void drvstat_add(struct drvstat *st, unsigned int counter, u64 value) {}
+static inline void drvstat_inc(struct drvstat *st, unsigned int counter) {}
+static inline void drvstat_hist_add(struct drvstat *st, unsigned int hist, u64 ns) {}
+static inline u64 drvstat_now(void) { return 0; }
+static inline void drvstat_hist_since(struct drvstat *st, unsigned int hist, u64 start) {}
+static inline void drvstat_init_root(struct dentry *root) {}
+static inline int drvstat_init(struct drvstat *st, const char * const *counter_names, unsigned int nr_counters,
+                               const char * const *hist_names, unsigned int nr_hists) { return 0; }
+static inline void drvstat_export(struct drvstat *st, struct dentry *parent, const char *name) {}
+static inline void drvstat_unexport(struct drvstat *st) {}
+static inline void drvstat_exit(struct drvstat *st) {}
+
+#endif /* DRVSTAT_DISABLE */
+
+#endif /* DRVSTAT_H */
@@ -9,17 +9,55 @@
 #include <linux/console.h>
 #include <linux/module.h>
 #include <linux/tty.h>
+#include <linux/serial.h>           // struct serial_icounter_struct for TIOCGICOUNT
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include "drvstat.h"
 
 MODULE_LICENSE("GPL");              ///< The license type -- this affects runtime behavior
 MODULE_AUTHOR("PHAM Minh Thuc");      ///< The author -- visible when you use modinfo
 MODULE_DESCRIPTION("Simple driver replace arm ALD5");  ///< The description -- see modinfo
 MODULE_VERSION("0.1");              ///< The version of the module
+#define TTYARM_TX_FIFO_SIZE 4096     ///< Bytes queued between write() and the arm
+
 static char message[256] = {0};  /// Memory for the string that is passed from userspace
 static short size_of_message;    ///< Used to remember the size of the string stored
 static const struct tty_port_operations ttyarm_port_ops;
 static struct tty_driver *ttyarm_driver;
 static struct tty_port ttyarm_port;
 
+/*
+ * Counters of the port given to TIOCGICOUNT, always kept. tx_bytes counts
+ * the bytes handed to the arm by the drain work, not the bytes accepted by
+ * write(). There is no receive path yet, so rx_bytes stays at 0 until the
+ * arm answers back. A full fifo loses nothing: write() returns a short
+ * count and the writer sends the rest again. overrun and buf_overrun of
+ * TIOCGICOUNT mean lost input for serial tools, so both stay at 0 and the
+ * back-pressure is only counted by the buffer_full drvstat counter.
+ */
+struct ttyarm_stats {
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;
+};
+
+/* Instrumentation of the port, see drvstat.h */
+enum { TTYARM_STAT_WRITES, TTYARM_STAT_TX_BYTES, TTYARM_STAT_FRAMES, TTYARM_STAT_REFUSED,
+       TTYARM_STAT_BUF_FULL, TTYARM_NR_STATS };
+static const char * const ttyarm_stat_names[] = { "writes", "tx_bytes", "frames", "refused_bytes", "buffer_full" };
+enum { TTYARM_HIST_TX_LATENCY, TTYARM_NR_HISTS };     ///< queued by write() -> drained to the arm
+static const char * const ttyarm_hist_names[] = { "tx_latency" };
+
+static DEFINE_SPINLOCK(ttyarm_lock);    ///< protects ttyarm_stats and tx_stamp
+static DEFINE_KFIFO(ttyarm_tx_fifo, unsigned char, TTYARM_TX_FIFO_SIZE);
+static struct ttyarm_stats ttyarm_stats;
+static u64 tx_stamp;                    ///< drvstat_now() when the oldest byte in the fifo was queued
+static struct dentry *ttyarm_debugfs;
+static struct drvstat ttyarm_drvstat;
+
+static void ttyarm_drain(struct work_struct *work);
+static DECLARE_WORK(ttyarm_drain_work, ttyarm_drain);
+
 static int ttyarm_open(struct tty_struct *tty, struct file *filp)
 {
     printk(KERN_INFO "ttyarm: device has been opened\n");
@@ -32,17 +70,83 @@ static void ttyarm_close(struct tty_struct *tty, struct file *filp)
 	tty_port_close(&ttyarm_port, tty, filp);
 }
 
+/* Hand the queued bytes to the arm, one '\n' terminated command at a time */
+static void ttyarm_drain(struct work_struct *work)
+{
+	unsigned char chunk[64];
+	unsigned long flags;
+	unsigned int len, i;
+	unsigned long frames = 0, bytes = 0;
+	u64 stamp;
+
+	spin_lock_irqsave(&ttyarm_lock, flags);
+	stamp = tx_stamp;
+	spin_unlock_irqrestore(&ttyarm_lock, flags);
+
+	while ((len = kfifo_out_spinlocked(&ttyarm_tx_fifo, chunk, sizeof(chunk), &ttyarm_lock))) {
+		for (i = 0; i < len; i++) {
+			if (chunk[i] == '\n' || size_of_message == sizeof(message) - 1) {
+				message[size_of_message] = '\0';
+				size_of_message = 0;
+				frames++;
+			}
+			if (chunk[i] != '\n')
+				message[size_of_message++] = chunk[i];
+		}
+		bytes += len;
+	}
+	if (!bytes)
+		return;
+
+	spin_lock_irqsave(&ttyarm_lock, flags);
+	ttyarm_stats.tx_bytes += bytes;
+	spin_unlock_irqrestore(&ttyarm_lock, flags);
+	drvstat_add(&ttyarm_drvstat, TTYARM_STAT_TX_BYTES, bytes);
+	drvstat_add(&ttyarm_drvstat, TTYARM_STAT_FRAMES, frames);
+	drvstat_hist_since(&ttyarm_drvstat, TTYARM_HIST_TX_LATENCY, stamp);
+
+	// room is available again for a writer waiting on write_room
+	tty_port_tty_wakeup(&ttyarm_port);
+}
+
 static int ttyarm_write(struct tty_struct *tty, const unsigned char *buf, int count)
 {
-    sprintf(message, "%s(%i letters",buf,count);
-    size_of_message = strlen(message);
-    printk(KERN_INFO "ttyarm: Recieved %i letters from the user: %s\n",count,message);
-	return count;
+	unsigned long flags;
+	unsigned int queued;
+
+	spin_lock_irqsave(&ttyarm_lock, flags);
+	if (kfifo_is_empty(&ttyarm_tx_fifo))
+		tx_stamp = drvstat_now();
+	queued = kfifo_in(&ttyarm_tx_fifo, buf, count);
+	spin_unlock_irqrestore(&ttyarm_lock, flags);
+
+	drvstat_inc(&ttyarm_drvstat, TTYARM_STAT_WRITES);
+	if (queued < count) {
+		drvstat_inc(&ttyarm_drvstat, TTYARM_STAT_BUF_FULL);
+		drvstat_add(&ttyarm_drvstat, TTYARM_STAT_REFUSED, count - queued);
+	}
+
+	if (queued)
+		schedule_work(&ttyarm_drain_work);
+	return queued;
 }
 
 static int ttyarm_write_room(struct tty_struct *tty)
 {
-	return 65536;
+	return kfifo_avail(&ttyarm_tx_fifo);
+}
+
+static int ttyarm_get_icount(struct tty_struct *tty, struct serial_icounter_struct *icount)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ttyarm_lock, flags);
+	icount->tx = ttyarm_stats.tx_bytes;
+	icount->rx = ttyarm_stats.rx_bytes;
+	icount->overrun = 0;            // no byte is ever lost, see struct ttyarm_stats
+	icount->buf_overrun = 0;
+	spin_unlock_irqrestore(&ttyarm_lock, flags);
+	return 0;
 }
 
 static const struct tty_operations ttyarm_ops = {
@@ -50,6 +154,7 @@ static const struct tty_operations ttyarm_ops = {
 	.close = ttyarm_close,
 	.write = ttyarm_write,
 	.write_room = ttyarm_write_room,
+	.get_icount = ttyarm_get_icount,
 };
 
 static struct tty_driver *ttyarm_device(struct console *c, int *index)
@@ -76,6 +181,17 @@ static int __init ttyarm_init(void)
 	if (IS_ERR(driver))
 		return PTR_ERR(driver);
 
+	// statistics are optional, the driver works without debugfs
+	ttyarm_debugfs = debugfs_create_dir("ttyarm", NULL);
+	drvstat_init_root(ttyarm_debugfs);
+	ret = drvstat_init(&ttyarm_drvstat, ttyarm_stat_names, TTYARM_NR_STATS, ttyarm_hist_names, TTYARM_NR_HISTS);
+	if (ret < 0) {
+		debugfs_remove_recursive(ttyarm_debugfs);
+		put_tty_driver(driver);
+		return ret;
+	}
+	drvstat_export(&ttyarm_drvstat, ttyarm_debugfs, "ttyarm0");
+
 	tty_port_init(&ttyarm_port);
 	ttyarm_port.ops = &ttyarm_port_ops;
 
@@ -89,6 +205,8 @@ static int __init ttyarm_init(void)
 
 	ret = tty_register_driver(driver);
 	if (ret < 0) {
+		drvstat_exit(&ttyarm_drvstat);
+		debugfs_remove_recursive(ttyarm_debugfs);
 		put_tty_driver(driver);
 		tty_port_destroy(&ttyarm_port);
 		return ret;
@@ -105,6 +223,9 @@ static void __exit ttyarm_exit(void)
 	printk(KERN_INFO "ttyarm: Exit driver ttyarm sucessfully\n");
 	unregister_console(&ttyarm_console);
 	tty_unregister_driver(ttyarm_driver);
+	cancel_work_sync(&ttyarm_drain_work);
+	drvstat_exit(&ttyarm_drvstat);
+	debugfs_remove_recursive(ttyarm_debugfs);
 	put_tty_driver(ttyarm_driver);
 	tty_port_destroy(&ttyarm_port);
 }
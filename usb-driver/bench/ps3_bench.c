@@ -0,0 +1,190 @@
+/**
+ * @file    ps3_bench.c
+ * @author  PHAM Minh Thuc
+ * @brief   Measures the report stream of ps3_driver through /dev/usb/ps3N: reports per second, reports
+ * lost and latency. With reports stamped by ps3_gadget, the end to end latency (gadget -> read()) is
+ * measured too. With -m, the reports are consumed from the mmap'd ring of the driver instead of read().
+ *    ./ps3_bench [-d /dev/usb/ps30] [-t seconds] [-m]
+*/
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<time.h>
+#include<poll.h>
+#include<sys/ioctl.h>
+#include<sys/mman.h>
+#include "../ps3_driver.h"
+#include "ps3_emul.h"
+
+#define MAX_SAMPLES (1 << 20)
+#define MMAP_SIZE (64 * 1024)
+
+struct samples {
+   uint64_t *ns;
+   unsigned long count;
+};
+
+static uint64_t now_ns() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+   uint64_t v = 0;
+   int i;
+   for (i = bytes - 1; i >= 0; i--)
+      v = v << 8 | p[i];
+   return v;
+}
+
+static void add_sample(struct samples *s, uint64_t ns) {
+   if (s->count < MAX_SAMPLES)
+      s->ns[s->count++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+   return x < y ? -1 : x > y;
+}
+
+static struct samples driver_lat, e2e_lat;
+static unsigned long reports, overruns, stream_lost, gadget_lost;
+static uint32_t last_seq, last_gadget_seq;
+static int have_seq, have_gadget_seq;
+
+// accounts one report received at now
+static void account(uint32_t seq, uint64_t timestamp_ns, const unsigned char *report, int len, uint64_t now) {
+   uint32_t gadget_seq;
+
+   reports++;
+   if (have_seq && seq != last_seq + 1)
+      stream_lost += seq - last_seq - 1;
+   last_seq = seq;
+   have_seq = 1;
+   add_sample(&driver_lat, now - timestamp_ns);
+
+   if (len >= STAMP_MIN_LEN && report[STAMP_MAGIC_OFFSET] == STAMP_MAGIC) {
+      gadget_seq = get_le(report + STAMP_SEQ_OFFSET, 4);
+      if (have_gadget_seq && gadget_seq != last_gadget_seq + 1)
+         gadget_lost += gadget_seq - last_gadget_seq - 1;
+      last_gadget_seq = gadget_seq;
+      have_gadget_seq = 1;
+      add_sample(&e2e_lat, now - get_le(report + STAMP_TIME_OFFSET, 8));
+   }
+}
+
+// consumes the mmap'd ring until end, sleeping in poll() only when it is empty
+static int bench_mmap(int fd, uint64_t end) {
+   struct ps3_mmap_ring *ring;
+   struct ps3_mmap_slot *slot;
+   struct pollfd pfd = { .fd = fd, .events = POLLIN };
+   uint32_t tail, head;
+
+   ring = mmap(NULL, MMAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (ring == MAP_FAILED) {
+      perror("Failed to map the ring of reports");
+      return -1;
+   }
+   tail = ring->tail;
+   while (now_ns() < end) {
+      head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+         poll(&pfd, 1, 100);
+         continue;
+      }
+      for (; tail != head; tail++) {
+         slot = &ring->slots[tail & (ring->nr_slots - 1)];
+         account(slot->seq, slot->timestamp_ns, slot->data, slot->len, now_ns());
+      }
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+   }
+   overruns = ring->dropped;
+   munmap(ring, MMAP_SIZE);
+   return 0;
+}
+
+static void print_latency(const char *name, struct samples *s) {
+   uint64_t sum = 0;
+   unsigned long i;
+
+   if (!s->count) {
+      printf("%s: no sample\n", name);
+      return;
+   }
+   qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+   for (i = 0; i < s->count; i++)
+      sum += s->ns[i];
+   printf("%s (us): min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n", name,
+          s->ns[0] / 1000.0, sum / (double)s->count / 1000.0, s->ns[s->count / 2] / 1000.0,
+          s->ns[s->count * 99 / 100] / 1000.0, s->ns[s->count - 1] / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+   const char *node = "/dev/usb/ps30";
+   int seconds = 10;
+   int fd, opt, ret, format = PS3_FMT_TIMESTAMPED, use_mmap = 0;
+   unsigned char buf[sizeof(struct ps3_report_hdr) + PS3_MAX_PKT_SIZE];
+   struct ps3_report_hdr *hdr = (struct ps3_report_hdr *)buf;
+   uint64_t start, end, now;
+
+   while ((opt = getopt(argc, argv, "d:t:m")) != -1) {
+      switch (opt) {
+         case 'd': node = optarg; break;
+         case 't': seconds = atoi(optarg); break;
+         case 'm': use_mmap = 1; break;
+         default:
+            fprintf(stderr, "usage: %s [-d device] [-t seconds] [-m]\n", argv[0]);
+            return 1;
+      }
+   }
+   driver_lat.ns = malloc(MAX_SAMPLES * sizeof(uint64_t));
+   e2e_lat.ns = malloc(MAX_SAMPLES * sizeof(uint64_t));
+   driver_lat.count = e2e_lat.count = 0;
+   if (!driver_lat.ns || !e2e_lat.ns)
+      return ENOMEM;
+
+   fd = open(node, use_mmap ? O_RDWR : O_RDONLY);    // a shared writable mapping needs O_RDWR
+   if (fd < 0) {
+      perror("Failed to open the device...");
+      return errno;
+   }
+   if (ioctl(fd, PS3_SET_FORMAT, &format) < 0) {
+      perror("Failed to select the timestamped format");
+      return errno;
+   }
+
+   start = now_ns();
+   end = start + (uint64_t)seconds * 1000000000ULL;
+   if (use_mmap && bench_mmap(fd, end) < 0)
+      return errno;
+   while (!use_mmap && now_ns() < end) {
+      ret = read(fd, buf, sizeof(buf));
+      now = now_ns();
+      if (ret < 0) {
+         if (errno == EOVERFLOW) {
+            // lapped by the stream, the lost reports show as a gap of seq
+            overruns++;
+            continue;
+         }
+         perror("Failed to read a report");
+         break;
+      }
+      account(hdr->seq, hdr->timestamp_ns, buf + sizeof(*hdr), hdr->len, now);
+   }
+   now = now_ns();
+   close(fd);
+
+   printf("reports: %lu in %.2f s (%.1f reports/s)\n", reports, (now - start) / 1e9, reports * 1e9 / (now - start));
+   printf("%s: %lu, reports lost by this reader: %lu\n", use_mmap ? "dropped (ring full)" : "overruns", overruns, stream_lost);
+   if (have_gadget_seq)
+      printf("reports sent by the gadget but never read: %lu\n", gadget_lost);
+   print_latency("urb completion -> read()", &driver_lat);
+   if (have_gadget_seq)
+      print_latency("gadget -> read()", &e2e_lat);
+   return 0;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file    ps3_emul.h
+ * @author  PHAM Minh Thuc
+ * @brief   Layout of the reports sent by ps3_gadget and checked by ps3_bench
+*/
+#ifndef PS3_EMUL_H
+#define PS3_EMUL_H
+
+#define PS3_VENDOR_ID 0x054c
+#define PS3_PRODUCT_ID 0x0268
+#define PS3_REPORT_ID 0x01
+#define PS3_REPORT_LEN 49       // length of a report of the real pad
+#define PS3_MAX_PKT_SIZE 64
+
+/*
+ * ps3_gadget stamps every report in bytes of the pad which are not decoded by ps3_driver, so the
+ * bench can measure the end to end latency and the reports lost before the driver:
+ * [STAMP_MAGIC_OFFSET]: STAMP_MAGIC, the report is stamped
+ * [STAMP_SEQ_OFFSET]: little endian 32 bits index of the report sent by the gadget
+ * [STAMP_TIME_OFFSET]: little endian 64 bits CLOCK_MONOTONIC ns when the report was given to the UDC
+ */
+#define STAMP_MAGIC_OFFSET 23
+#define STAMP_MAGIC 0xa5
+#define STAMP_SEQ_OFFSET 24
+#define STAMP_TIME_OFFSET 28
+#define STAMP_MIN_LEN 36        // shorter reports are sent without stamp
+
+#endif
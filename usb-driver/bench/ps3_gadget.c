@@ -0,0 +1,335 @@
+/**
+ * @file    ps3_gadget.c
+ * @author  PHAM Minh Thuc
+ * @brief   Emulates a PS3 pad (054c:0268, interrupt endpoints 0x81/0x02) with raw-gadget, so ps3_driver
+ * can be tested without hardware. Run it on the same machine with dummy_hcd loaded:
+ *    modprobe dummy_hcd; modprobe raw_gadget
+ *    ./ps3_gadget -r 1000 -l 49
+ * Options:
+ *    -r rate      reports per second, 0 = as fast as the host polls (default 250)
+ *    -l length    bytes per report, 1~64 (default 49)
+ *    -i interval  bInterval of the endpoints (default 1)
+ *    -s speed     full or high (default full, like the real pad)
+ *    -d driver -n device   UDC to use (default dummy_udc / dummy_udc.0)
+*/
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<stdbool.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<signal.h>
+#include<pthread.h>
+#include<time.h>
+#include<sys/ioctl.h>
+#include<linux/usb/ch9.h>
+#include<linux/usb/raw_gadget.h>
+#include "ps3_emul.h"
+
+#define EP_IN_ADDR (USB_DIR_IN | 1)
+#define EP_OUT_ADDR (USB_DIR_OUT | 2)
+#define EP0_MAX_DATA 256
+
+struct usb_raw_control_event {
+   struct usb_raw_event inner;
+   struct usb_ctrlrequest ctrl;
+};
+
+struct usb_raw_control_io {
+   struct usb_raw_ep_io inner;
+   char data[EP0_MAX_DATA];
+};
+
+struct usb_raw_int_io {
+   struct usb_raw_ep_io inner;
+   char data[PS3_MAX_PKT_SIZE];
+};
+
+static int fd;
+static int ep_in = -1, ep_out = -1;
+static unsigned int rate = 250;
+static unsigned int report_len = PS3_REPORT_LEN;
+static volatile sig_atomic_t stop;
+static unsigned long sent, received;
+static pthread_t in_thread, out_thread;
+
+static struct usb_device_descriptor dev_desc = {
+   .bLength = USB_DT_DEVICE_SIZE,
+   .bDescriptorType = USB_DT_DEVICE,
+   .bcdUSB = 0x0200,
+   .bDeviceClass = 0,
+   .bMaxPacketSize0 = 64,
+   .idVendor = PS3_VENDOR_ID,
+   .idProduct = PS3_PRODUCT_ID,
+   .bcdDevice = 0x0100,
+   .iManufacturer = 1,
+   .iProduct = 2,
+   .iSerialNumber = 0,
+   .bNumConfigurations = 1,
+};
+
+// The real pad is a HID interface. A vendor class keeps usbhid from claiming the emulated pad first,
+// ps3_driver matches on vendor/product only.
+static struct {
+   struct usb_config_descriptor config;
+   struct usb_interface_descriptor iface;
+   struct usb_endpoint_descriptor ep_in;
+   struct usb_endpoint_descriptor ep_out;
+} __attribute__((packed)) config_desc = {
+   .config = {
+      .bLength = USB_DT_CONFIG_SIZE,
+      .bDescriptorType = USB_DT_CONFIG,
+      .wTotalLength = sizeof(config_desc),
+      .bNumInterfaces = 1,
+      .bConfigurationValue = 1,
+      .bmAttributes = USB_CONFIG_ATT_ONE,
+      .bMaxPower = 250,
+   },
+   .iface = {
+      .bLength = USB_DT_INTERFACE_SIZE,
+      .bDescriptorType = USB_DT_INTERFACE,
+      .bNumEndpoints = 2,
+      .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+   },
+   .ep_in = {
+      .bLength = USB_DT_ENDPOINT_SIZE,
+      .bDescriptorType = USB_DT_ENDPOINT,
+      .bEndpointAddress = EP_IN_ADDR,
+      .bmAttributes = USB_ENDPOINT_XFER_INT,
+      .wMaxPacketSize = PS3_MAX_PKT_SIZE,
+      .bInterval = 1,
+   },
+   .ep_out = {
+      .bLength = USB_DT_ENDPOINT_SIZE,
+      .bDescriptorType = USB_DT_ENDPOINT,
+      .bEndpointAddress = EP_OUT_ADDR,
+      .bmAttributes = USB_ENDPOINT_XFER_INT,
+      .wMaxPacketSize = PS3_MAX_PKT_SIZE,
+      .bInterval = 1,
+   },
+};
+
+static const char *strings[] = { NULL, "Sony", "PLAYSTATION(R)3 Controller" };
+
+static uint64_t now_ns() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put_le(unsigned char *p, uint64_t v, int bytes) {
+   int i;
+   for (i = 0; i < bytes; i++)
+      p[i] = v >> (8 * i);
+}
+
+// string descriptor i in data, returns its length
+static int string_desc(int i, char *data) {
+   int len, j;
+   if (i == 0) {
+      // supported languages: en-US
+      data[0] = 4; data[1] = USB_DT_STRING; data[2] = 0x09; data[3] = 0x04;
+      return 4;
+   }
+   if (i >= (int)(sizeof(strings) / sizeof(strings[0])))
+      return -1;
+   len = strlen(strings[i]);
+   data[0] = 2 + 2 * len;
+   data[1] = USB_DT_STRING;
+   for (j = 0; j < len; j++) {
+      data[2 + 2 * j] = strings[i][j];
+      data[3 + 2 * j] = 0;
+   }
+   return 2 + 2 * len;
+}
+
+static void *send_reports(void *arg) {
+   struct usb_raw_int_io io;
+   unsigned char *report = (unsigned char *)io.data;
+   uint64_t period = rate ? 1000000000ULL / rate : 0;
+   uint64_t next = now_ns();
+   struct timespec ts;
+   uint32_t seq;
+
+   for (seq = 0; !stop; seq++) {
+      if (period) {
+         next += period;
+         ts.tv_sec = next / 1000000000ULL;
+         ts.tv_nsec = next % 1000000000ULL;
+         clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      }
+      memset(report, 0, sizeof(io.data));
+      report[0] = PS3_REPORT_ID;
+      if (report_len > 9) {
+         // press cross every 64 reports and move the left stick slowly, so the input device gets events
+         report[3] = (seq & 64) ? 0x40 : 0;
+         report[6] = 128 + (int)((seq >> 2) % 64) - 32;
+         report[7] = report[8] = report[9] = 128;
+      }
+      if (report_len >= STAMP_MIN_LEN) {
+         report[STAMP_MAGIC_OFFSET] = STAMP_MAGIC;
+         put_le(report + STAMP_SEQ_OFFSET, seq, 4);
+         put_le(report + STAMP_TIME_OFFSET, now_ns(), 8);
+      }
+      io.inner.ep = ep_in;
+      io.inner.flags = 0;
+      io.inner.length = report_len;
+      // blocks until the host polls the endpoint
+      if (ioctl(fd, USB_RAW_IOCTL_EP_WRITE, &io) < 0) {
+         if (!stop)
+            perror("ps3_gadget: write report");
+         break;
+      }
+      sent++;
+   }
+   return NULL;
+}
+
+static void *receive_reports(void *arg) {
+   struct usb_raw_int_io io;
+
+   while (!stop) {
+      io.inner.ep = ep_out;
+      io.inner.flags = 0;
+      io.inner.length = sizeof(io.data);
+      if (ioctl(fd, USB_RAW_IOCTL_EP_READ, &io) < 0)
+         break;
+      received++;
+   }
+   return NULL;
+}
+
+static int set_configuration() {
+   if (ep_in >= 0)
+      return 0;      // already configured, the reports are flowing
+   ep_in = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, &config_desc.ep_in);
+   ep_out = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, &config_desc.ep_out);
+   if (ep_in < 0 || ep_out < 0) {
+      perror("ps3_gadget: enable endpoints");
+      return -1;
+   }
+   ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, config_desc.config.bMaxPower);
+   if (ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0) {
+      perror("ps3_gadget: configure");
+      return -1;
+   }
+   pthread_create(&in_thread, NULL, send_reports, NULL);
+   pthread_create(&out_thread, NULL, receive_reports, NULL);
+   return 0;
+}
+
+// returns the length of the answer in io.data, -1 to stall
+static int handle_control(struct usb_ctrlrequest *ctrl, struct usb_raw_control_io *io) {
+   int type = ctrl->wValue >> 8;
+   int index = ctrl->wValue & 0xff;
+
+   if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+      return 0;      // class requests of the host (e.g. SET_IDLE) are simply acknowledged
+   switch (ctrl->bRequest) {
+      case USB_REQ_GET_DESCRIPTOR:
+         if (type == USB_DT_DEVICE) {
+            memcpy(io->data, &dev_desc, sizeof(dev_desc));
+            return sizeof(dev_desc);
+         }
+         if (type == USB_DT_CONFIG) {
+            memcpy(io->data, &config_desc, sizeof(config_desc));
+            return sizeof(config_desc);
+         }
+         if (type == USB_DT_STRING)
+            return string_desc(index, io->data);
+         return -1;  // no device qualifier: the pad is a full speed device
+      case USB_REQ_SET_CONFIGURATION:
+         return set_configuration() < 0 ? -1 : 0;
+      case USB_REQ_SET_INTERFACE:
+         return 0;
+      case USB_REQ_GET_STATUS:
+         io->data[0] = io->data[1] = 0;
+         return 2;
+      default:
+         return -1;
+   }
+}
+
+static void on_signal(int sig) {
+   stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+   struct usb_raw_init init;
+   struct usb_raw_control_event event;
+   struct usb_raw_control_io io;
+   struct sigaction sa;
+   const char *driver = "dummy_udc", *device = "dummy_udc.0";
+   int speed = USB_SPEED_FULL;
+   int opt, len;
+
+   while ((opt = getopt(argc, argv, "r:l:i:s:d:n:")) != -1) {
+      switch (opt) {
+         case 'r': rate = atoi(optarg); break;
+         case 'l': report_len = atoi(optarg); break;
+         case 'i': config_desc.ep_in.bInterval = config_desc.ep_out.bInterval = atoi(optarg); break;
+         case 's': speed = strcmp(optarg, "high") ? USB_SPEED_FULL : USB_SPEED_HIGH; break;
+         case 'd': driver = optarg; break;
+         case 'n': device = optarg; break;
+         default:
+            fprintf(stderr, "usage: %s [-r rate] [-l length] [-i interval] [-s full|high] [-d udc driver] [-n udc device]\n", argv[0]);
+            return 1;
+      }
+   }
+   if (report_len < 1 || report_len > PS3_MAX_PKT_SIZE) {
+      fprintf(stderr, "ps3_gadget: length must be 1~%d\n", PS3_MAX_PKT_SIZE);
+      return 1;
+   }
+   // no SA_RESTART: a signal must end the blocking EVENT_FETCH
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = on_signal;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   fd = open("/dev/raw-gadget", O_RDWR);
+   if (fd < 0) {
+      perror("ps3_gadget: open /dev/raw-gadget (is raw_gadget loaded?)");
+      return errno;
+   }
+   memset(&init, 0, sizeof(init));
+   strncpy((char *)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+   strncpy((char *)init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+   init.speed = speed;
+   if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+      perror("ps3_gadget: start gadget");
+      return errno;
+   }
+   printf("ps3_gadget: emulating %04x:%04x, %u reports/s of %u bytes\n", PS3_VENDOR_ID, PS3_PRODUCT_ID, rate, report_len);
+
+   while (!stop) {
+      event.inner.type = 0;
+      event.inner.length = sizeof(event.ctrl);
+      if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0)
+         break;
+      if (event.inner.type != USB_RAW_EVENT_CONTROL)
+         continue;
+
+      len = handle_control(&event.ctrl, &io);
+      if (len < 0) {
+         ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+         continue;
+      }
+      io.inner.ep = 0;
+      io.inner.flags = 0;
+      if (event.ctrl.bRequestType & USB_DIR_IN) {
+         io.inner.length = len < event.ctrl.wLength ? len : event.ctrl.wLength;
+         ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+      } else {
+         // acknowledge the status stage, and take the data of the request if any
+         io.inner.length = event.ctrl.wLength < EP0_MAX_DATA ? event.ctrl.wLength : EP0_MAX_DATA;
+         ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io);
+      }
+   }
+
+   // the threads may be blocked in an endpoint transfer, exit() tears them down with the gadget
+   stop = 1;
+   printf("ps3_gadget: sent %lu reports, received %lu output reports\n", sent, received);
+   return 0;
+}
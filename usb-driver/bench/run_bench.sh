@@ -0,0 +1,34 @@
+#!/bin/sh
+# Runs ps3_bench against a pad emulated by ps3_gadget on dummy_hcd.
+# usage: sudo ./run_bench.sh [rate] [length] [seconds]
+set -e
+
+RATE=${1:-1000}
+LENGTH=${2:-49}
+SECONDS_RUN=${3:-10}
+DIR=$(cd "$(dirname "$0")" && pwd)
+
+gcc -O2 -Wall -o "$DIR/ps3_gadget" "$DIR/ps3_gadget.c" -lpthread
+gcc -O2 -Wall -o "$DIR/ps3_bench" "$DIR/ps3_bench.c"
+
+modprobe dummy_hcd
+modprobe raw_gadget
+lsmod | grep -q ps3_driver || insmod "$DIR/../ps3_driver.ko"
+
+"$DIR/ps3_gadget" -r "$RATE" -l "$LENGTH" &
+GADGET=$!
+trap 'kill $GADGET 2>/dev/null' EXIT
+
+# wait for the emulated pad to be enumerated and bound to ps3_driver
+for i in $(seq 50); do
+	NODE=$(ls /dev/usb/ps3* 2>/dev/null | head -n 1)
+	[ -n "$NODE" ] && break
+	sleep 0.1
+done
+if [ -z "$NODE" ]; then
+	echo "run_bench: no /dev/usb/ps3N, check dmesg" >&2
+	exit 1
+fi
+
+"$DIR/ps3_bench" -d "$NODE" -t "$SECONDS_RUN"
+cat /sys/kernel/debug/ps3_driver/*/counters /sys/kernel/debug/ps3_driver/*/histograms 2>/dev/null || true
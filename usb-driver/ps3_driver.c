@@ -1,7 +1,24 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/uaccess.h>
+#include <linux/fs.h>
 #include <linux/usb.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/input.h>
+#include <linux/usb/input.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include "ps3_driver.h"
+#include "drvstat.h"
 
 // a device can have multiple interfaces
 // a interface bind to a driver specific
@@ -16,30 +33,596 @@
 #define INT_EP_IN 0x81
 #define INT_EP_OUT 0x02
 #define MAX_PKT_SIZE 64
+#define NUM_IN_URBS 4       // interrupt-IN urbs kept in flight, so no report is missed between two reads
+#define RING_SIZE 32        // reports kept for the readers, must be a power of 2
+#define PS3_OUT_SLOTS 4     // output reports waiting to be sent, one per report id (LEDs/rumble)
+#define PS3_MINOR_BASE 192  // first minor when CONFIG_USB_DYNAMIC_MINORS is not set, leaves room for many pads
 
-static struct usb_device *device;
-static struct usb_class_driver class;       // identifies driver usb
-static unsigned char interrupt_buf[MAX_PKT_SIZE];
+/*
+ * Layout of the input report (report id 0x01, 49 bytes):
+ * byte 2: select, L3, R3, start, up, right, down, left
+ * byte 3: L2, R2, L1, R1, triangle, circle, cross, square
+ * byte 4: bit0 PS button
+ * byte 6~9: left stick X/Y, right stick X/Y (0~255, center 128)
+ * byte 18~19: analog L2/R2 (0~255)
+ */
+#define PS3_REPORT_ID 0x01
+#define PS3_BUTTONS_OFFSET 2
+#define PS3_DECODE_LEN 20   // shortest report that holds every decoded field
+#define PS3_NUM_AXES 6
+#define PS3_STICK_AXES 4    // the first PS3_NUM_AXES entries centered on PS3_AXIS_CENTER
+#define PS3_AXIS_CENTER 128
+
+// code of the button for every bit of [byte 4:byte 3:byte 2]
+static const unsigned short ps3_buttons[] = {
+    BTN_SELECT, BTN_THUMBL, BTN_THUMBR, BTN_START, BTN_DPAD_UP, BTN_DPAD_RIGHT, BTN_DPAD_DOWN, BTN_DPAD_LEFT,
+    BTN_TL2, BTN_TR2, BTN_TL, BTN_TR, BTN_NORTH, BTN_EAST, BTN_SOUTH, BTN_WEST,
+    BTN_MODE,
+};
+#define PS3_BUTTONS_MASK GENMASK(ARRAY_SIZE(ps3_buttons) - 1, 0)
+
+static const struct {
+    unsigned char offset;
+    unsigned short code;
+} ps3_axes[PS3_NUM_AXES] = {
+    { 6, ABS_X }, { 7, ABS_Y }, { 8, ABS_RX }, { 9, ABS_RY },
+    { 18, ABS_Z }, { 19, ABS_RZ },
+};
+
+static int axis_deadzone = 8;
+module_param(axis_deadzone, int, 0644);
+MODULE_PARM_DESC(axis_deadzone, "stick values closer to the center than this are reported as centered");
+static int axis_fuzz = 2;
+module_param(axis_fuzz, int, 0644);
+MODULE_PARM_DESC(axis_fuzz, "axis changes smaller or equal to this are not reported");
+
+struct ps3_report {
+    unsigned char data[MAX_PKT_SIZE];
+    int len;
+    u64 timestamp_ns;                       // completion of the urb, ktime_get_ns()
+    u32 seq;
+};
+
+// instrumentation of a pad, in /sys/kernel/debug/ps3_driver/<usb device>/
+enum {
+    PS3_STAT_REPORTS,
+    PS3_STAT_URB_ERRORS,                    // completions with a transient error, the urb is resubmitted
+    PS3_STAT_OVERRUNS,                      // times a reader was lapped by the stream
+    PS3_STAT_LOST,                          // reports overwritten before a lapped reader got them
+    PS3_STAT_OUT_COALESCED,                 // pending output reports replaced before being sent
+    PS3_NR_STATS,
+};
+
+static const char * const ps3_stat_names[PS3_NR_STATS] = {
+    "reports", "urb_errors", "overruns", "lost", "out_coalesced",
+};
+
+enum {
+    PS3_HIST_INTERVAL,                      // between two reports of the pad
+    PS3_HIST_LATENCY,                       // from the urb completion to read()
+    PS3_NR_HISTS,
+};
+
+static const char * const ps3_hist_names[PS3_NR_HISTS] = {
+    "interval", "latency",
+};
+
+// an output report waiting for the out urb, replaced by a newer write with the same report id
+struct ps3_out_slot {
+    bool pending;
+    unsigned long seq;                      // order of the write, the oldest slot is sent first
+    unsigned char data[MAX_PKT_SIZE];
+    int len;
+};
+
+// state of one plugged pad, alive as long as the interface is bound or a file is opened on it
+struct ps3_dev {
+    struct usb_device *udev;
+    struct usb_interface *interface;
+    struct kref kref;
+    bool disconnected;                      // set under out_lock, so no out urb is submitted after it
+
+    // writes are queued in out_slots and sent one at a time by out_urb, write() does not wait for the pad
+    struct urb *out_urb;
+    struct ps3_out_slot out_slots[PS3_OUT_SLOTS];
+    bool out_busy;                          // out_urb is in flight
+    int out_error;                          // status of the last output report, given to the next sync write
+    unsigned long out_seq;
+    spinlock_t out_lock;
+    wait_queue_head_t out_wait;
+    char phys[64];
+
+    // decoded state last sent to the input device, only touched by the urb completion
+    struct input_dev *input;
+    unsigned long buttons;
+    int axes[PS3_NUM_AXES];
+
+    // reports are streamed continuously by the urbs of in_anchor into ring, shared by all the readers.
+    // The stream never waits for a reader: the oldest report is overwritten when the ring wraps.
+    struct usb_anchor in_anchor;
+    struct urb *in_urbs[NUM_IN_URBS];
+    struct ps3_report ring[RING_SIZE];
+    unsigned int ring_head;                 // free running index of the next report written
+    spinlock_t ring_lock;                   // protects the ring, the cursors of the readers, mmap_readers and last_timestamp_ns
+    wait_queue_head_t ring_wait;
+    struct list_head mmap_readers;          // readers with a mapped ring, filled by the urb completion
+
+    // on a stall all the urbs are unlinked and wait in stall_anchor until stall_work has cleared the halt
+    struct usb_anchor stall_anchor;
+    struct work_struct stall_work;
+    bool in_stopped;                        // set by ps3_stop_streaming, no urb is parked or resubmitted after it
+
+    u64 last_timestamp_ns;                  // of the previous report, for the interval histogram
+
+    struct drvstat stats;
+};
+
+// one per opened file, so every process sees the whole stream of the pad
+struct ps3_reader {
+    struct ps3_dev *dev;
+    unsigned int tail;                      // free running index of the next report read
+    unsigned long overruns;                 // times the reader was lapped by the stream
+    int format;                             // PS3_FMT_*
+
+    // ring mapped in user space, see struct ps3_mmap_ring. The indexes used by the driver are kept
+    // here: the mapped header is writable by user space and only informative for the driver.
+    bool mmap_claimed;                      // a ring is being or has been mapped on this file
+    struct ps3_mmap_ring *mmap_ring;
+    unsigned int mmap_nr_slots;
+    unsigned int mmap_head;
+    unsigned int mmap_dropped;
+    struct list_head mmap_node;
+};
+
+static struct dentry *ps3_debugfs_root;
+
+// called with ring_lock held, from the urb completion
+static void ps3_mmap_push(struct ps3_reader *reader, const struct ps3_report *report)
+{
+    struct ps3_mmap_ring *ring = reader->mmap_ring;
+    struct ps3_mmap_slot *slot;
+
+    if (reader->mmap_head - READ_ONCE(ring->tail) >= reader->mmap_nr_slots) {
+        // the consumer owns the slots between tail and head, never overwrite them
+        WRITE_ONCE(ring->dropped, ++reader->mmap_dropped);
+        return;
+    }
+    slot = &ring->slots[reader->mmap_head & (reader->mmap_nr_slots - 1)];
+    slot->timestamp_ns = report->timestamp_ns;
+    slot->seq = report->seq;
+    slot->len = report->len;
+    slot->flags = 0;
+    memcpy(slot->data, report->data, report->len);
+    // the slot must be visible before the new head
+    smp_store_release(&ring->head, ++reader->mmap_head);
+}
+
+#define to_ps3_dev(d) container_of(d, struct ps3_dev, kref)
+
+static struct usb_driver ps3_driver;
+
+static void ps3_delete(struct kref *kref)
+{
+    struct ps3_dev *dev = to_ps3_dev(kref);
+
+    drvstat_exit(&dev->stats);
+    usb_put_dev(dev->udev);
+    kfree(dev);
+}
+
+/* Send to the input device only the buttons and axes which changed since the previous report */
+static void ps3_report_input(struct ps3_dev *dev, const unsigned char *data, int len)
+{
+    unsigned long buttons, changed;
+    bool sync = false;
+    int i, value, rest;
+
+    if (len < PS3_DECODE_LEN || data[0] != PS3_REPORT_ID)
+        return;
+
+    buttons = (data[PS3_BUTTONS_OFFSET] | data[PS3_BUTTONS_OFFSET + 1] << 8 | data[PS3_BUTTONS_OFFSET + 2] << 16) & PS3_BUTTONS_MASK;
+    changed = buttons ^ dev->buttons;
+    for_each_set_bit(i, &changed, ARRAY_SIZE(ps3_buttons))
+        input_report_key(dev->input, ps3_buttons[i], buttons & BIT(i));
+    if (changed) {
+        dev->buttons = buttons;
+        sync = true;
+    }
+
+    for (i = 0; i < PS3_NUM_AXES; i++) {
+        rest = i < PS3_STICK_AXES ? PS3_AXIS_CENTER : 0;
+        value = data[ps3_axes[i].offset];
+        if (i < PS3_STICK_AXES && abs(value - rest) <= axis_deadzone)
+            value = rest;
+        // the rest position is always sent, so a released stick or trigger never stays slightly off
+        if (value == dev->axes[i] || (abs(value - dev->axes[i]) <= axis_fuzz && value != rest))
+            continue;
+        input_report_abs(dev->input, ps3_axes[i].code, value);
+        dev->axes[i] = value;
+        sync = true;
+    }
+
+    if (sync)
+        input_sync(dev->input);
+}
+
+static void ps3_in_complete(struct urb *urb)
+{
+    struct ps3_dev *dev = urb->context;
+    struct ps3_report *report;
+    struct ps3_reader *reader;
+    unsigned long flags;
+    u64 now = ktime_get_ns();
+    int retval;
+
+    switch (urb->status) {
+    case 0:
+        break;
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+        // urb killed by disconnect: stop this urb
+        return;
+    case -EPIPE:
+        // endpoint stalled: usb_clear_halt() sleeps, so the urb is parked and resubmitted from a work item
+        drvstat_inc(&dev->stats, PS3_STAT_URB_ERRORS);
+        if (READ_ONCE(dev->in_stopped))
+            return;
+        dev_warn_ratelimited(&dev->interface->dev, "interrupt endpoint stalled, clearing the halt\n");
+        usb_anchor_urb(urb, &dev->stall_anchor);
+        schedule_work(&dev->stall_work);
+        return;
+    default:
+        // transient error, keep the stream alive
+        drvstat_inc(&dev->stats, PS3_STAT_URB_ERRORS);
+        goto resubmit;
+    }
+
+    spin_lock_irqsave(&dev->ring_lock, flags);
+    report = &dev->ring[dev->ring_head & (RING_SIZE - 1)];
+    report->len = MIN(urb->actual_length, MAX_PKT_SIZE);
+    memcpy(report->data, urb->transfer_buffer, report->len);
+    report->timestamp_ns = now;
+    report->seq = dev->ring_head;
+    dev->ring_head++;
+    if (dev->last_timestamp_ns)
+        drvstat_hist_add(&dev->stats, PS3_HIST_INTERVAL, now - dev->last_timestamp_ns);
+    dev->last_timestamp_ns = now;
+    list_for_each_entry(reader, &dev->mmap_readers, mmap_node)
+        ps3_mmap_push(reader, report);
+    spin_unlock_irqrestore(&dev->ring_lock, flags);
+    wake_up_interruptible(&dev->ring_wait);
+    drvstat_inc(&dev->stats, PS3_STAT_REPORTS);
+
+    // completions of one endpoint are given back one after the other, no lock needed for the decoded state
+    ps3_report_input(dev, urb->transfer_buffer, urb->actual_length);
+
+resubmit:
+    usb_anchor_urb(urb, &dev->in_anchor);
+    retval = usb_submit_urb(urb, GFP_ATOMIC);
+    if (retval) {
+        usb_unanchor_urb(urb);
+        // -EPERM: the urb is being killed by ps3_stall_work or ps3_stop_streaming, which resubmit or free it
+        if (retval != -EPERM)
+            dev_err_ratelimited(&dev->interface->dev, "failed to resubmit interrupt urb %d\n", retval);
+    }
+}
+
+static void ps3_stall_work(struct work_struct *work)
+{
+    struct ps3_dev *dev = container_of(work, struct ps3_dev, stall_work);
+    struct urb *urb;
+    int i;
+    int retval;
+
+    if (READ_ONCE(dev->in_stopped))
+        return;
+    // the urbs still queued on the halted endpoint are unlinked before the halt (and the data toggle) is cleared,
+    // then all the urbs wait in stall_anchor, none is in flight
+    usb_kill_anchored_urbs(&dev->in_anchor);
+    usb_scuttle_anchored_urbs(&dev->stall_anchor);
+    for (i = 0; i < NUM_IN_URBS; i++)
+        usb_anchor_urb(dev->in_urbs[i], &dev->stall_anchor);
+    retval = usb_clear_halt(dev->udev, dev->in_urbs[0]->pipe);
+    if (retval)
+        dev_err_ratelimited(&dev->interface->dev, "failed to clear the interrupt endpoint halt %d\n", retval);
+    // resubmitted even if clear_halt failed: a still stalled endpoint parks the urb again
+    while ((urb = usb_get_from_anchor(&dev->stall_anchor))) {
+        usb_anchor_urb(urb, &dev->in_anchor);
+        retval = usb_submit_urb(urb, GFP_KERNEL);
+        if (retval) {
+            usb_unanchor_urb(urb);
+            dev_err_ratelimited(&dev->interface->dev, "failed to resubmit interrupt urb %d\n", retval);
+        }
+        usb_free_urb(urb);
+    }
+}
+
+static void ps3_stop_streaming(struct ps3_dev *dev)
+{
+    int i;
+
+    // the work running when in_stopped is set is waited for, a completion racing with it runs a work that does nothing
+    WRITE_ONCE(dev->in_stopped, true);
+    cancel_work_sync(&dev->stall_work);
+    usb_kill_anchored_urbs(&dev->in_anchor);
+    cancel_work_sync(&dev->stall_work);
+    usb_scuttle_anchored_urbs(&dev->stall_anchor);
+    for (i = 0; i < NUM_IN_URBS; i++) {
+        if (!dev->in_urbs[i])
+            continue;
+        usb_free_coherent(dev->udev, MAX_PKT_SIZE, dev->in_urbs[i]->transfer_buffer, dev->in_urbs[i]->transfer_dma);
+        usb_free_urb(dev->in_urbs[i]);
+        dev->in_urbs[i] = NULL;
+    }
+}
+
+static int ps3_start_streaming(struct ps3_dev *dev, struct usb_endpoint_descriptor *ep_in)
+{
+    unsigned char *buf;
+    int i;
+    int retval;
+
+    for (i = 0; i < NUM_IN_URBS; i++) {
+        dev->in_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+        if (!dev->in_urbs[i]) {
+            retval = -ENOMEM;
+            goto error;
+        }
+        buf = usb_alloc_coherent(dev->udev, MAX_PKT_SIZE, GFP_KERNEL, &dev->in_urbs[i]->transfer_dma);
+        if (!buf) {
+            usb_free_urb(dev->in_urbs[i]);
+            dev->in_urbs[i] = NULL;
+            retval = -ENOMEM;
+            goto error;
+        }
+        usb_fill_int_urb(dev->in_urbs[i], dev->udev, usb_rcvintpipe(dev->udev, ep_in->bEndpointAddress),
+                         buf, MAX_PKT_SIZE, ps3_in_complete, dev, ep_in->bInterval);
+        dev->in_urbs[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+        usb_anchor_urb(dev->in_urbs[i], &dev->in_anchor);
+        retval = usb_submit_urb(dev->in_urbs[i], GFP_KERNEL);
+        if (retval) {
+            usb_unanchor_urb(dev->in_urbs[i]);
+            dev_err(&dev->interface->dev, "failed to submit interrupt urb %d\n", retval);
+            goto error;
+        }
+    }
+    return 0;
+
+error:
+    ps3_stop_streaming(dev);
+    return retval;
+}
+
+// called with out_lock held
+static void ps3_out_kick(struct ps3_dev *dev)
+{
+    struct ps3_out_slot *slot = NULL;
+    int i;
+    int retval;
+
+    if (dev->out_busy || dev->disconnected)
+        return;
+    for (i = 0; i < PS3_OUT_SLOTS; i++) {
+        if (dev->out_slots[i].pending && (!slot || dev->out_slots[i].seq < slot->seq))
+            slot = &dev->out_slots[i];
+    }
+    if (!slot)
+        return;
+
+    memcpy(dev->out_urb->transfer_buffer, slot->data, slot->len);
+    dev->out_urb->transfer_buffer_length = slot->len;
+    slot->pending = false;
+    retval = usb_submit_urb(dev->out_urb, GFP_ATOMIC);
+    if (retval) {
+        dev->out_error = retval;
+        dev_err(&dev->interface->dev, "failed to submit output urb %d\n", retval);
+        wake_up_interruptible(&dev->out_wait);
+        return;
+    }
+    dev->out_busy = true;
+}
+
+static void ps3_out_complete(struct urb *urb)
+{
+    struct ps3_dev *dev = urb->context;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->out_lock, flags);
+    dev->out_busy = false;
+    if (urb->status) {
+        dev->out_error = urb->status;
+        if (urb->status != -ENOENT && urb->status != -ECONNRESET && urb->status != -ESHUTDOWN)
+            dev_err_ratelimited(&dev->interface->dev, "output urb returned %d\n", urb->status);
+    }
+    ps3_out_kick(dev);
+    spin_unlock_irqrestore(&dev->out_lock, flags);
+    wake_up_interruptible(&dev->out_wait);
+}
+
+// called with out_lock held: the pending slot of this report id, or a free one
+static struct ps3_out_slot *ps3_out_slot_get(struct ps3_dev *dev, unsigned char report_id)
+{
+    struct ps3_out_slot *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < PS3_OUT_SLOTS; i++) {
+        if (!dev->out_slots[i].pending) {
+            if (!free_slot)
+                free_slot = &dev->out_slots[i];
+        } else if (dev->out_slots[i].data[0] == report_id) {
+            return &dev->out_slots[i];
+        }
+    }
+    return free_slot;
+}
+
+static bool ps3_out_can_queue(struct ps3_dev *dev, unsigned char report_id)
+{
+    bool ret;
+
+    spin_lock_irq(&dev->out_lock);
+    ret = dev->disconnected || ps3_out_slot_get(dev, report_id);
+    spin_unlock_irq(&dev->out_lock);
+    return ret;
+}
+
+static bool ps3_out_idle(struct ps3_dev *dev)
+{
+    bool ret;
+    int i;
+
+    spin_lock_irq(&dev->out_lock);
+    ret = !dev->out_busy || dev->disconnected;
+    for (i = 0; i < PS3_OUT_SLOTS && ret && !dev->disconnected; i++)
+        ret = !dev->out_slots[i].pending;
+    spin_unlock_irq(&dev->out_lock);
+    return ret;
+}
 
 static int ps3_open(struct inode *ind, struct file *f) {
+    struct usb_interface *interface;
+    struct ps3_dev *dev;
+    struct ps3_reader *reader;
+
+    // usbcore holds the minor lock during open, so disconnect can not free dev under us
+    interface = usb_find_interface(&ps3_driver, iminor(ind));
+    if (!interface)
+        return -ENODEV;
+    dev = usb_get_intfdata(interface);
+    if (!dev)
+        return -ENODEV;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader)
+        return -ENOMEM;
+    kref_get(&dev->kref);
+    reader->dev = dev;
+    // a new reader starts with the next report, not with the history of the ring
+    spin_lock_irq(&dev->ring_lock);
+    reader->tail = dev->ring_head;
+    spin_unlock_irq(&dev->ring_lock);
+    f->private_data = reader;
     return 0;
 }
 
 static int ps3_close(struct inode *ind, struct file *f) {
+    struct ps3_reader *reader = f->private_data;
+    struct ps3_dev *dev = reader->dev;
+
+    // the mapping holds a reference on the file, so the ring is not mapped anymore here
+    if (reader->mmap_ring) {
+        spin_lock_irq(&dev->ring_lock);
+        list_del(&reader->mmap_node);
+        spin_unlock_irq(&dev->ring_lock);
+        vfree(reader->mmap_ring);
+    }
+    kref_put(&dev->kref, ps3_delete);
+    kfree(reader);
     return 0;
 }
 
-static ssize_t ps3_read(struct file *f, char __user *buf, size_t cnt, loff_t *off) {    // ssize_t for return also error code
+static int ps3_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    struct ps3_reader *reader = f->private_data;
+    struct ps3_dev *dev = reader->dev;
+    struct ps3_mmap_ring *ring;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned int nr_slots;
     int retval;
-    int read_cnt;
 
-    /* Read the data from interrupt endpoint */
-    retval = usb_interrupt_msg(device, usb_rcvintpipe(device, INT_EP_IN), interrupt_buf, MAX_PKT_SIZE, &read_cnt, 5000);
+    BUILD_BUG_ON(sizeof(ring->slots[0].data) < MAX_PKT_SIZE);
+    if (vma->vm_pgoff || !(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    // the ring is vmalloc'ed by the driver, its size is not left to the caller
+    if (size < sizeof(*ring) + 2 * sizeof(struct ps3_mmap_slot) ||
+        size > PAGE_ALIGN(sizeof(*ring) + PS3_MMAP_MAX_SLOTS * sizeof(struct ps3_mmap_slot)))
+        return -EINVAL;
+    nr_slots = rounddown_pow_of_two((size - sizeof(*ring)) / sizeof(struct ps3_mmap_slot));
+
+    // one ring per opened file, the file is the cursor of the consumer
+    spin_lock_irq(&dev->ring_lock);
+    if (reader->mmap_claimed) {
+        spin_unlock_irq(&dev->ring_lock);
+        return -EBUSY;
+    }
+    reader->mmap_claimed = true;
+    spin_unlock_irq(&dev->ring_lock);
+
+    ring = vmalloc_user(size);
+    if (!ring) {
+        retval = -ENOMEM;
+        goto error;
+    }
+    ring->nr_slots = nr_slots;
+    retval = remap_vmalloc_range(vma, ring, 0);
     if (retval) {
-        printk(KERN_ERR "interrupt message returned %d\n", retval);
-        return retval;
+        vfree(ring);
+        goto error;
+    }
+
+    spin_lock_irq(&dev->ring_lock);
+    reader->mmap_ring = ring;
+    reader->mmap_nr_slots = nr_slots;
+    list_add_tail(&reader->mmap_node, &dev->mmap_readers);
+    spin_unlock_irq(&dev->ring_lock);
+    return 0;
+
+error:
+    spin_lock_irq(&dev->ring_lock);
+    reader->mmap_claimed = false;
+    spin_unlock_irq(&dev->ring_lock);
+    return retval;
+}
+
+static ssize_t ps3_read(struct file *f, char __user *buf, size_t cnt, loff_t *off) {    // ssize_t for return also error code
+    struct ps3_reader *reader = f->private_data;
+    struct ps3_dev *dev = reader->dev;
+    struct ps3_report report;
+    struct ps3_report_hdr hdr;
+    int read_cnt;
+
+    if (reader->format == PS3_FMT_TIMESTAMPED && cnt < sizeof(hdr))
+        return -EINVAL;
+
+    /* Take the oldest report of the stream this reader did not see yet */
+    spin_lock_irq(&dev->ring_lock);
+    while (dev->ring_head == reader->tail) {
+        spin_unlock_irq(&dev->ring_lock);
+        if (READ_ONCE(dev->disconnected))
+            return -ENODEV;
+        if (f->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->ring_wait, READ_ONCE(dev->ring_head) != reader->tail || READ_ONCE(dev->disconnected)))
+            return -ERESTARTSYS;
+        spin_lock_irq(&dev->ring_lock);
+    }
+    if (dev->ring_head - reader->tail > RING_SIZE) {
+        // the stream lapped this reader: report it once, then continue with the oldest report kept
+        drvstat_add(&dev->stats, PS3_STAT_LOST, dev->ring_head - RING_SIZE - reader->tail);
+        drvstat_inc(&dev->stats, PS3_STAT_OVERRUNS);
+        reader->tail = dev->ring_head - RING_SIZE;
+        reader->overruns++;
+        spin_unlock_irq(&dev->ring_lock);
+        return -EOVERFLOW;
     }
-    if (copy_to_user(buf, interrupt_buf, MIN(cnt, read_cnt))) {
+    report = dev->ring[reader->tail & (RING_SIZE - 1)];
+    reader->tail++;
+    spin_unlock_irq(&dev->ring_lock);
+    drvstat_hist_since(&dev->stats, PS3_HIST_LATENCY, report.timestamp_ns);
+
+    if (reader->format == PS3_FMT_TIMESTAMPED) {
+        hdr.timestamp_ns = report.timestamp_ns;
+        hdr.seq = report.seq;
+        hdr.len = MIN(cnt - sizeof(hdr), report.len);
+        hdr.flags = 0;
+        if (copy_to_user(buf, &hdr, sizeof(hdr)) || copy_to_user(buf + sizeof(hdr), report.data, hdr.len))
+            return -EFAULT;
+        return sizeof(hdr) + hdr.len;
+    }
+
+    read_cnt = report.len;
+    if (copy_to_user(buf, report.data, MIN(cnt, read_cnt))) {
         printk(KERN_ERR "failed to copy data to user space %d\n", -EFAULT);
         return -EFAULT;
     }
@@ -47,37 +630,197 @@ static ssize_t ps3_read(struct file *f, char __user *buf, size_t cnt, loff_t *of
     return MIN(cnt, read_cnt);
 }
 
+static long ps3_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+    struct ps3_reader *reader = f->private_data;
+    int format;
+
+    switch (cmd) {
+    case PS3_SET_FORMAT:
+        if (get_user(format, (int __user *)arg))
+            return -EFAULT;
+        if (format != PS3_FMT_RAW && format != PS3_FMT_TIMESTAMPED)
+            return -EINVAL;
+        reader->format = format;
+        return 0;
+    case PS3_GET_FORMAT:
+        return put_user(reader->format, (int __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * Queue an output report. The first byte is the report id: a report still waiting with the same id
+ * is replaced, so only the latest LEDs/rumble state goes to the pad. write() returns once the report
+ * is queued, unless the file is opened with O_SYNC/O_DSYNC: it then waits until the queue is sent.
+ */
 static ssize_t ps3_write(struct file *f, const char __user *buf, size_t cnt, loff_t *off)
 {
+    struct ps3_dev *dev = ((struct ps3_reader *)f->private_data)->dev;
+    struct ps3_out_slot *slot;
+    unsigned char data[MAX_PKT_SIZE];
     int retval;
     int wrote_cnt = MIN(cnt, MAX_PKT_SIZE);
 
-    if (copy_from_user(interrupt_buf, buf, wrote_cnt)) {
+    if (wrote_cnt == 0)
+        return 0;
+    if (copy_from_user(data, buf, wrote_cnt)) {
         printk(KERN_ERR "failed to copy data from user space %d\n", -EFAULT);
         return -EFAULT;
     }
 
-    /* Write data into interrupt endpoint*/
-    retval = usb_interrupt_msg(device, usb_sndintpipe(device, INT_EP_OUT), interrupt_buf, MIN(cnt, MAX_PKT_SIZE), &wrote_cnt, 5000);
-    if (retval) {
-        printk(KERN_ERR "interrupt message returned %d\n", retval);
-        return retval;
+    spin_lock_irq(&dev->out_lock);
+    while (!dev->disconnected && !(slot = ps3_out_slot_get(dev, data[0]))) {
+        // PS3_OUT_SLOTS different report ids are already waiting
+        spin_unlock_irq(&dev->out_lock);
+        if (f->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->out_wait, ps3_out_can_queue(dev, data[0])))
+            return -ERESTARTSYS;
+        spin_lock_irq(&dev->out_lock);
+    }
+    if (dev->disconnected) {
+        spin_unlock_irq(&dev->out_lock);
+        return -ENODEV;
     }
+    if (slot->pending)
+        drvstat_inc(&dev->stats, PS3_STAT_OUT_COALESCED);
+    memcpy(slot->data, data, wrote_cnt);
+    slot->len = wrote_cnt;
+    slot->seq = ++dev->out_seq;
+    slot->pending = true;
+    ps3_out_kick(dev);
+    spin_unlock_irq(&dev->out_lock);
+
+    if (!(f->f_flags & O_DSYNC))
+        return wrote_cnt;
+
+    if (wait_event_interruptible(dev->out_wait, ps3_out_idle(dev)))
+        return -ERESTARTSYS;
+    spin_lock_irq(&dev->out_lock);
+    retval = dev->disconnected ? -ENODEV : dev->out_error;
+    dev->out_error = 0;
+    spin_unlock_irq(&dev->out_lock);
+    return retval ? retval : wrote_cnt;
+}
+
+static __poll_t ps3_poll(struct file *f, poll_table *wait)
+{
+    struct ps3_reader *reader = f->private_data;
+    struct ps3_dev *dev = reader->dev;
+    __poll_t mask = 0;
+    int i;
 
-    return wrote_cnt;
+    poll_wait(f, &dev->ring_wait, wait);
+    poll_wait(f, &dev->out_wait, wait);
+    if (reader->mmap_ring) {
+        // a mapped ring is consumed without read(): readable while it is not empty
+        if (READ_ONCE(reader->mmap_ring->tail) != READ_ONCE(reader->mmap_head))
+            mask |= EPOLLIN | EPOLLRDNORM;
+    } else if (READ_ONCE(dev->ring_head) != reader->tail) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    for (i = 0; i < PS3_OUT_SLOTS; i++) {
+        if (!READ_ONCE(dev->out_slots[i].pending)) {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+            break;
+        }
+    }
+    if (READ_ONCE(dev->disconnected))
+        mask |= EPOLLHUP | EPOLLERR;
+    return mask;
 }
 
 static struct file_operations fops = {
+    .owner = THIS_MODULE,                   // opened files outlive disconnect, they must pin the module too
     .open = ps3_open,
     .release = ps3_close,
     .read = ps3_read,
     .write = ps3_write,
+    .poll = ps3_poll,
+    .unlocked_ioctl = ps3_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,       // the argument is an int __user *, same layout for 32-bit callers
+    .mmap = ps3_mmap,
+};
+
+static struct usb_class_driver class = {    // identifies driver usb, shared by all pads
+    .name = "usb/ps3%d",
+    .fops = &fops,
+    .minor_base = PS3_MINOR_BASE,
 };
 
+static int ps3_alloc_out_urb(struct ps3_dev *dev, struct usb_endpoint_descriptor *ep_out)
+{
+    unsigned char *buf;
+
+    dev->out_urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!dev->out_urb)
+        return -ENOMEM;
+    buf = usb_alloc_coherent(dev->udev, MAX_PKT_SIZE, GFP_KERNEL, &dev->out_urb->transfer_dma);
+    if (!buf) {
+        usb_free_urb(dev->out_urb);
+        dev->out_urb = NULL;
+        return -ENOMEM;
+    }
+    usb_fill_int_urb(dev->out_urb, dev->udev, usb_sndintpipe(dev->udev, ep_out->bEndpointAddress),
+                     buf, MAX_PKT_SIZE, ps3_out_complete, dev, ep_out->bInterval);
+    dev->out_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    return 0;
+}
+
+static void ps3_free_out_urb(struct ps3_dev *dev)
+{
+    if (!dev->out_urb)
+        return;
+    usb_kill_urb(dev->out_urb);
+    usb_free_coherent(dev->udev, MAX_PKT_SIZE, dev->out_urb->transfer_buffer, dev->out_urb->transfer_dma);
+    usb_free_urb(dev->out_urb);
+    dev->out_urb = NULL;
+}
+
+static int ps3_register_input(struct ps3_dev *dev)
+{
+    struct input_dev *input;
+    int i;
+    int retval;
+
+    input = input_allocate_device();
+    if (!input)
+        return -ENOMEM;
+
+    usb_make_path(dev->udev, dev->phys, sizeof(dev->phys));
+    strlcat(dev->phys, "/input0", sizeof(dev->phys));
+    input->name = "Sony PLAYSTATION(R)3 Controller";
+    input->phys = dev->phys;
+    usb_to_input_id(dev->udev, &input->id);
+    input->dev.parent = &dev->interface->dev;
+
+    for (i = 0; i < ARRAY_SIZE(ps3_buttons); i++)
+        input_set_capability(input, EV_KEY, ps3_buttons[i]);
+    // fuzz is already applied by ps3_report_input, the deadzone is exported as flat for joydev users
+    for (i = 0; i < PS3_NUM_AXES; i++) {
+        input_set_abs_params(input, ps3_axes[i].code, 0, 255, 0, i < PS3_STICK_AXES ? axis_deadzone : 0);
+        dev->axes[i] = i < PS3_STICK_AXES ? PS3_AXIS_CENTER : 0;
+        input_abs_set_val(input, ps3_axes[i].code, dev->axes[i]);
+    }
+
+    retval = input_register_device(input);
+    if (retval) {
+        input_free_device(input);
+        return retval;
+    }
+    dev->input = input;
+    return 0;
+}
+
 static int ps3_probe(struct usb_interface *interface, const struct usb_device_id *id)
 {
     struct usb_host_interface *iface_desc;
     struct usb_endpoint_descriptor *endpoint;
+    struct usb_endpoint_descriptor *ep_in = NULL;
+    struct usb_endpoint_descriptor *ep_out = NULL;
+    struct ps3_dev *dev;
     int i;
     int retval;
 
@@ -90,23 +833,88 @@ static int ps3_probe(struct usb_interface *interface, const struct usb_device_id
         printk(KERN_INFO "Endpoint [%d] address %02X\n", i, endpoint->bEndpointAddress);
         printk(KERN_INFO "Endpoint [%d] attribute %02X\n", i, endpoint->bmAttributes);
         printk(KERN_INFO "Endpoint [%d] max packet size %04X (%d)\n", i, endpoint->wMaxPacketSize, endpoint->wMaxPacketSize);
+        if (endpoint->bEndpointAddress == INT_EP_IN && usb_endpoint_xfer_int(endpoint))
+            ep_in = endpoint;
+        if (endpoint->bEndpointAddress == INT_EP_OUT && usb_endpoint_xfer_int(endpoint))
+            ep_out = endpoint;
+    }
+    if (!ep_in || !ep_out) {
+        printk(KERN_ERR "interrupt endpoints %02X/%02X not found\n", INT_EP_IN, INT_EP_OUT);
+        return -ENODEV;
     }
 
-    device = interface_to_usbdev(interface);
-    class.name = "usb/ps3%d";
-    class.fops = &fops;
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
+        return -ENOMEM;
+    kref_init(&dev->kref);
+    spin_lock_init(&dev->ring_lock);
+    init_waitqueue_head(&dev->ring_wait);
+    spin_lock_init(&dev->out_lock);
+    init_waitqueue_head(&dev->out_wait);
+    init_usb_anchor(&dev->in_anchor);
+    init_usb_anchor(&dev->stall_anchor);
+    INIT_WORK(&dev->stall_work, ps3_stall_work);
+    INIT_LIST_HEAD(&dev->mmap_readers);
+    dev->udev = usb_get_dev(interface_to_usbdev(interface));
+    dev->interface = interface;
+    usb_set_intfdata(interface, dev);
+
+    // counted from the first report, exported once the pad has its name
+    if ((retval = drvstat_init(&dev->stats, ps3_stat_names, PS3_NR_STATS, ps3_hist_names, PS3_NR_HISTS)) < 0)
+        goto error;
+    if ((retval = ps3_alloc_out_urb(dev, ep_out)) < 0)
+        goto error;
+    if ((retval = ps3_register_input(dev)) < 0) {
+        printk(KERN_ERR "Not able to register input device: %d", retval);
+        goto error_out;
+    }
+    if ((retval = ps3_start_streaming(dev, ep_in)) < 0)
+        goto error_input;
     if ((retval = usb_register_dev(interface, &class)) < 0) {
         printk(KERN_ERR "Not able to assign a minor for device usb: %d", retval);
-    } else {
-        printk(KERN_INFO "Minor obtained: %d\n", interface->minor);
+        ps3_stop_streaming(dev);
+        goto error_input;
     }
+    printk(KERN_INFO "Minor obtained: %d\n", interface->minor);
+
+    // named after the class device (ps3N, as /dev/usb/ps3N), removed by disconnect, the counters are freed with dev
+    drvstat_export(&dev->stats, ps3_debugfs_root, dev_name(interface->usb_dev));
+    return 0;
+
+error_input:
+    input_unregister_device(dev->input);
+error_out:
+    ps3_free_out_urb(dev);
+error:
+    usb_set_intfdata(interface, NULL);
+    kref_put(&dev->kref, ps3_delete);
     return retval;
 }
 
 static void ps3_disconnect(struct usb_interface *interface)
 {
+    struct ps3_dev *dev = usb_get_intfdata(interface);
+    int minor = interface->minor;
+
+    usb_set_intfdata(interface, NULL);
+    drvstat_unexport(&dev->stats);
+    // no new open after this point
     usb_deregister_dev(interface, &class);
-    printk(KERN_INFO "PS3 i/f %d now disconnected\n", interface->cur_altsetting->desc.bInterfaceNumber);
+
+    // no output report is submitted once disconnected is set
+    spin_lock_irq(&dev->out_lock);
+    WRITE_ONCE(dev->disconnected, true);
+    spin_unlock_irq(&dev->out_lock);
+
+    ps3_stop_streaming(dev);
+    ps3_free_out_urb(dev);
+    wake_up_interruptible(&dev->ring_wait);
+    wake_up_interruptible(&dev->out_wait);
+    input_unregister_device(dev->input);
+
+    // opened files keep dev alive until they are closed
+    kref_put(&dev->kref, ps3_delete);
+    printk(KERN_INFO "PS3 i/f %d (minor %d) now disconnected\n", interface->cur_altsetting->desc.bInterfaceNumber, minor);
 }
 
 static struct usb_device_id ps3_table[] =
@@ -125,15 +933,23 @@ static struct usb_driver ps3_driver = {
 };
 
 static int __init ps3_init(void) {
-    return usb_register(&ps3_driver);
+    int retval;
+
+    ps3_debugfs_root = debugfs_create_dir("ps3_driver", NULL);
+    drvstat_init_root(ps3_debugfs_root);
+    retval = usb_register(&ps3_driver);
+    if (retval)
+        debugfs_remove_recursive(ps3_debugfs_root);
+    return retval;
 }
 
 static void __exit ps3_exit(void) {
     usb_deregister(&ps3_driver);
+    debugfs_remove_recursive(ps3_debugfs_root);
 }
 
 module_init(ps3_init);
 module_exit(ps3_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("PHAM Minh Thuc");
-MODULE_DESCRIPTION("USB PS3 Registration Driver");
\ No newline at end of file
+MODULE_DESCRIPTION("USB PS3 Registration Driver");
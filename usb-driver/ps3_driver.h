@@ -0,0 +1,58 @@
+/**
+ * @file    ps3_driver.h
+ * @author  PHAM Minh Thuc
+ * @brief   Definitions shared by ps3_driver and the programs reading /dev/usb/ps3N
+*/
+#ifndef PS3_DRIVER_H
+#define PS3_DRIVER_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Format of the reports returned by read(), selected per opened file with PS3_SET_FORMAT:
+ * - PS3_FMT_RAW (default): the report as sent by the pad
+ * - PS3_FMT_TIMESTAMPED: a struct ps3_report_hdr followed by the report
+ */
+#define PS3_FMT_RAW 0
+#define PS3_FMT_TIMESTAMPED 1
+
+struct ps3_report_hdr {
+    __u64 timestamp_ns;     // completion time of the interrupt urb, CLOCK_MONOTONIC
+    __u32 seq;              // index of the report in the stream of the pad, a gap means lost reports
+    __u16 len;              // bytes of report following the header
+    __u16 flags;            // reserved, 0
+};
+
+/*
+ * Ring of reports shared with user space by mmap() of /dev/usb/ps3N (offset 0, MAP_SHARED, read and
+ * write). The driver fills slots[head % nr_slots] then increases head, the program consumes
+ * slots[tail % nr_slots] then increases tail: no syscall is needed while reports are available.
+ * When the ring is full, new reports are not stored and dropped is increased. poll() reports POLLIN
+ * while tail != head, so a consumer only sleeps when the ring is empty.
+ * The number of slots is the largest power of 2 fitting in the mapped size, at most PS3_MMAP_MAX_SLOTS:
+ * a mapping larger than the page aligned size of a ring of PS3_MMAP_MAX_SLOTS slots fails with EINVAL.
+ */
+#define PS3_MMAP_MAX_SLOTS 4096
+struct ps3_mmap_slot {
+    __u64 timestamp_ns;     // as in struct ps3_report_hdr
+    __u32 seq;
+    __u16 len;
+    __u16 flags;
+    __u8 data[64];
+};
+
+struct ps3_mmap_ring {
+    __u32 head;             // written by the driver only
+    __u32 tail;             // written by user space only
+    __u32 nr_slots;
+    __u32 dropped;
+    __u64 reserved[6];      // slots start on a 64 bytes boundary
+    struct ps3_mmap_slot slots[];
+};
+
+#define PS3_MAGIC 'P'
+#define PS3_SET_FORMAT _IOW(PS3_MAGIC, 0, int)
+#define PS3_GET_FORMAT _IOR(PS3_MAGIC, 1, int)
+
+#endif